@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "wsh_internal.h"
+
+
+/**
+ * Reads input from stdin and then stores it in the cmd_buf passed
+ */
+static int read_cmd(wsh_ctx *ctx, char **cmd, size_t *cmd_sz) {
+    // the output of the last command goes out first so the prompt shows up after it
+    wsh_out_flush(ctx);
+    if(write(ctx->stdout_fd, "wsh> ", 5) != 5) return -1;
+
+    int cmdLength = getline(cmd, cmd_sz, stdin);
+    if(cmdLength == -1) return -1;
+
+    return 0;
+}
+
+
+/**
+ * Frees the session and returns the exit code of wsh
+ * A profiled run writes its reports, with WSH_STATS set the counters and the memory accounting are
+ * printed to stderr first
+ */
+static int end_session(wsh_ctx *ctx) {
+    int rc = ctx->is_err ? -1 : 0;
+
+    if(ctx->profile != NULL) wsh_profile_write(ctx);
+
+    if(getenv("WSH_STATS") != NULL) {
+        wsh_out_flush(ctx);
+        ctx->out = STDERR_FILENO;
+        wsh_print_stats(ctx);
+        wsh_print_mem(ctx);
+    }
+
+    wsh_ctx_free(ctx);
+    return rc;
+}
+
+
+int main(int argc, char* argv[]) {
+
+    // wsh [--restore snapshot] [--profile] [batch file]
+    const char *restore = NULL;
+    bool profile = false;
+    int first_arg = 1;
+
+    while(first_arg < argc) {
+        if(strcmp(argv[first_arg], "--restore") == 0 && first_arg + 1 < argc) {
+            restore = argv[first_arg + 1];
+            first_arg += 2;
+        }
+        else if(strcmp(argv[first_arg], "--profile") == 0) {
+            profile = true;
+            first_arg++;
+        }
+        else {
+            break;
+        }
+    }
+
+    // if more than 1 argument is left then it's an error, a profile needs a script
+    if(argc - first_arg > 1 || (profile && argc == first_arg)) {
+        exit(-1);
+    }
+
+    wsh_ctx *ctx = wsh_ctx_new();
+    if(ctx == NULL) {
+        exit(-1);
+    }
+
+    // the session starts from the saved state instead of replaying the commands that built it
+    if(restore != NULL && wsh_snapshot_load(ctx, restore) == -1) {
+        wsh_ctx_free(ctx);
+        exit(-1);
+    }
+
+    // if an argument is left then it is batch mode
+    // with that argument being the batch file name
+    if(argc == first_arg + 1) {
+        // Batch Mode
+        // WSH_TAILEXEC lets the last command replace wsh, its own exit code is then returned as is
+        char *tail_exec = getenv("WSH_TAILEXEC");
+        // the exit stats and the profile need wsh to outlive the last command
+        ctx->tail_exec = tail_exec != NULL && strlen(tail_exec) > 0 && strcmp(tail_exec, "0") != 0 && getenv("WSH_STATS") == NULL && !profile;
+
+        if(profile && wsh_profile_start(ctx, argv[first_arg]) == -1) {
+            wsh_ctx_free(ctx);
+            exit(-1);
+        }
+
+        wsh_eval_file(ctx, argv[first_arg]);
+
+        return end_session(ctx);
+    }
+
+    // commands piped into wsh are streamed like a batch file, without prompts
+    if(!isatty(ctx->stdin_fd)) {
+        wsh_run_stream(ctx, ctx->stdin_fd);
+
+        return end_session(ctx);
+    }
+
+    char *cmd_buf = NULL;
+    size_t cmd_buf_sz = 0;
+
+    // the read_cmd function prints 'wsh> ' and takes input from the user
+    while(!ctx->exited && read_cmd(ctx, &cmd_buf, &cmd_buf_sz) >= 0) {
+        if(strlen(cmd_buf) <= 1 || cmd_buf[0] == '#') continue;
+
+        wsh_eval_line(ctx, cmd_buf);
+    }
+    
+    free(cmd_buf);
+
+    return end_session(ctx);
+}
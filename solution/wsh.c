@@ -10,74 +10,464 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <ctype.h>
-#include "wsh.h"
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <stdarg.h>
+#include "wsh_internal.h"
+
+extern char **environ;
+
+static void free_memory(wsh_ctx *);
+static int count_cmd_args(wsh_ctx *);
+static int setString(wsh_ctx *, char **, size_t *, const char *, size_t);
+
+static void memAccount(wsh_ctx *, int, long, bool);
+static void * wsh_malloc(wsh_ctx *, int, size_t);
+static void * wsh_calloc(wsh_ctx *, int, size_t, size_t);
+static void * wsh_realloc(wsh_ctx *, int, void *, size_t);
+static char * wsh_strdup(wsh_ctx *, int, const char *);
+static void wsh_free(wsh_ctx *, void *);
+
+struct iovec;
+static int writeAll(int, struct iovec *, int);
+static int out_write(wsh_ctx *, const char *, size_t);
+static int out_printf(wsh_ctx *, const char *, ...) __attribute__((format(printf, 2, 3)));
+
+static void reader_init(wsh_ctx *, LineReader *, int);
+static char * reader_next_line(LineReader *, size_t *);
+static bool reader_at_end(LineReader *);
+static void reader_free(LineReader *);
+
+static char * getEnv(wsh_ctx *, const char *);
+static int setEnv(wsh_ctx *, const char *);
+static void envChanged(wsh_ctx *, const char *);
+static char * getVarValue(wsh_ctx *, char *);
+static int replace_vars(wsh_ctx *);
+
+static void clear_redirection_vars(wsh_ctx *);
+static int set_redirection(wsh_ctx *);
+static int unset_redirection(wsh_ctx *);
+static int apply_redirection(wsh_ctx *);
+static int check_redirection(wsh_ctx *, char *);
+static int appendBytes(wsh_ctx *, char **, size_t *, size_t *, const char *, size_t);
+static int heredoc_put(wsh_ctx *, const char *, size_t);
+static int heredoc_append(wsh_ctx *, char *, size_t, bool);
+static int read_heredoc(wsh_ctx *);
+static int heredoc_open(wsh_ctx *);
+
+static char * parse_procsub(wsh_ctx *, char *, char **);
+static int start_procsubs(wsh_ctx *);
+static void reap_procsubs(wsh_ctx *);
+
+static void printHistory(wsh_ctx *);
+static char * searchHistory(wsh_ctx *, int);
+static void updateHistControl(wsh_ctx *);
+static void addHistoryEntry(wsh_ctx *, const char *);
+static void addToHistory(wsh_ctx *);
+static void updateHistoryCapacity(wsh_ctx *, int);
+static unsigned long hashString(const char *);
+static unsigned long hashBytes(unsigned long, const void *, size_t);
+static HistNode * findHistory(wsh_ctx *, const char *, unsigned long);
+static void histSetInsert(wsh_ctx *, HistNode *);
+static void histSetRemove(wsh_ctx *, HistNode *);
+static unsigned int trigramBucket(const char *);
+static void fenwickAdd(HistIndex *, unsigned long, int);
+static int fenwickSum(HistIndex *, unsigned long);
+static int indexHistNode(wsh_ctx *, HistNode *);
+static int buildHistIndex(wsh_ctx *);
+static void freeHistIndex(wsh_ctx *);
+static void removeHistNode(wsh_ctx *, HistNode *);
+static int historySearch(wsh_ctx *, const char *);
+static int history(wsh_ctx *, bool *);
+
+static int exclude_hidden_files(const struct dirent *);
+static int ls(wsh_ctx *);
+static int cd(wsh_ctx *);
+static int export(wsh_ctx *);
+
+static int vars(wsh_ctx *);
+static char * searchLocal(wsh_ctx *, char *);
+static int setLocal(wsh_ctx *, const char *, const char *);
+static int local(wsh_ctx *);
+
+static int builtin_ulimit(wsh_ctx *);
+static int checkLimit(int, rlim_t);
+static int stats(wsh_ctx *);
+static int mem(wsh_ctx *);
+static size_t snapshot_put(char *, const char *);
+static const char * snapshot_next(const char **, const char *);
+static int snapshot_save(wsh_ctx *, const char *);
+static int snapshot(wsh_ctx *);
+static int parse_prefixes(wsh_ctx *);
+static bool cpuInMask(const unsigned long *, int);
+static int parse_cpulist(const char *, unsigned long *);
+static int nextCpu(wsh_ctx *);
+static int forall(wsh_ctx *);
+
+static int resolve_cmd(wsh_ctx *, const char *, char *, size_t);
+static void child_setup(wsh_ctx *);
+static long rusageCpuUs(const struct rusage *);
+static bool wait_deadline(pid_t, long);
+static int wait_cmd(wsh_ctx *, pid_t, long);
+static int exec_replace(wsh_ctx *, char **);
+static int exec(wsh_ctx *);
+static int run_cmd(wsh_ctx *);
+
+static int cache_key_add(wsh_ctx *, char **, size_t *, size_t *, const char *, const char *);
+static int cache_key_file(wsh_ctx *, char **, size_t *, size_t *, const char *, bool);
+static int cache_dir_open(wsh_ctx *);
+static void cache_replay(wsh_ctx *, const char *, size_t, const char *, size_t);
+static int cache_lookup(wsh_ctx *, int, const char *, const char *, size_t);
+static int cache_store(wsh_ctx *, int, const char *, const char *, size_t, const char *, size_t, const char *, size_t);
+static int compareCacheFiles(const void *, const void *);
+static int cache_evict(wsh_ctx *, int, long);
+static int cache_run(wsh_ctx *, int, const char *, const char *, size_t);
+static int cached(wsh_ctx *);
+
+static long monotonicMs(void);
+static int watch_add(wsh_ctx *, WatchSet *, const char *);
+static int watch_drain(wsh_ctx *, WatchSet *);
+static void watch_free(wsh_ctx *, WatchSet *);
+static int on_change(wsh_ctx *);
+static int parse_cmd(wsh_ctx *, char *);
+static int exec_cmd(wsh_ctx *);
+
+static long monotonicUs(void);
+static char * profile_frames(wsh_ctx *, const char *);
+static void profile_line(wsh_ctx *, unsigned long, const char *, size_t);
+static int compareProfileLines(const void *, const void *);
+static void profile_free(wsh_ctx *);
+
+static int run_batch_mode(wsh_ctx *, const char *);
+
+typedef struct LimitSpec {
+    char flag;
+    int resource;
+    rlim_t unit;
+    const char *name;
+} LimitSpec;
+
+// resources understood by ulimit, the values are given in units of unit bytes / items
+static const LimitSpec limit_specs[NLIMITS] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (blocks)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (blocks)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+};
+
+
+static const char *mem_names[MEM_SUBSYSTEMS] = {"history", "locals", "parse", "env", "io"};
 
-int history_capacity = HISTORY_SIZE;
-int curr_history_size = 0;
 
-HistNode *histHead = NULL;
-HistNode *histTail = NULL;
+/**
+ * Allocation layer, every block the session allocates is counted against one of the subsystems
+ * The size and subsystem are kept in a header in front of the block so frees get accounted too
+ */
+static void memAccount(wsh_ctx *ctx, int subsystem, long delta, bool is_alloc) {
+    MemStats *mem = &ctx->mem[subsystem];
+
+    mem->live += delta;
+    if(mem->live > mem->peak) mem->peak = mem->live;
+    if(is_alloc) mem->allocs++;
+
+    ctx->mem_live += delta;
+    if(ctx->mem_live > ctx->mem_peak) ctx->mem_peak = ctx->mem_live;
+}
+
+
+static void * wsh_malloc(wsh_ctx *ctx, int subsystem, size_t size) {
+    if(size > SIZE_MAX - sizeof(MemHeader)) return NULL;
+
+    MemHeader *header = malloc(sizeof(MemHeader) + size);
+    if(header == NULL) return NULL;
+
+    header->size = size;
+    header->subsystem = subsystem;
+    memAccount(ctx, subsystem, size, true);
+
+    return header + 1;
+}
+
+
+static void * wsh_calloc(wsh_ctx *ctx, int subsystem, size_t nmemb, size_t size) {
+    // like calloc a size that doesn't fit in a size_t fails instead of wrapping around
+    if(size != 0 && nmemb > SIZE_MAX / size) return NULL;
+
+    void *ptr = wsh_malloc(ctx, subsystem, nmemb * size);
+    if(ptr != NULL) memset(ptr, 0, nmemb * size);
+
+    return ptr;
+}
+
+
+static void * wsh_realloc(wsh_ctx *ctx, int subsystem, void *ptr, size_t size) {
+    if(ptr == NULL) return wsh_malloc(ctx, subsystem, size);
+
+    if(size > SIZE_MAX - sizeof(MemHeader)) return NULL;
+
+    MemHeader *header = (MemHeader*) ptr - 1;
+    size_t old_size = header->size;
+
+    header = realloc(header, sizeof(MemHeader) + size);
+    if(header == NULL) return NULL;
+
+    header->size = size;
+    memAccount(ctx, header->subsystem, (long) size - (long) old_size, true);
+
+    return header + 1;
+}
+
+
+static char * wsh_strdup(wsh_ctx *ctx, int subsystem, const char *str) {
+    size_t len = strlen(str);
+    char *dup = wsh_malloc(ctx, subsystem, len + 1);
+    if(dup != NULL) memcpy(dup, str, len + 1);
+
+    return dup;
+}
+
+
+static void wsh_free(wsh_ctx *ctx, void *ptr) {
+    if(ptr == NULL) return;
+
+    MemHeader *header = (MemHeader*) ptr - 1;
+    memAccount(ctx, header->subsystem, -(long) header->size, false);
+
+    free(header);
+}
+
+
+/**
+ * Creates a new shell session
+ * The environment is copied from the process with PATH reset to /bin and the working directory
+ * is the current directory of the process
+ */
+wsh_ctx * wsh_ctx_new(void) {
+    wsh_ctx *ctx = (wsh_ctx*) calloc(1, sizeof(wsh_ctx));
+    if(ctx == NULL) return NULL;
 
-LocalNode *localHead = NULL;
+    ctx->history_capacity = HISTORY_SIZE;
 
-// stores the tokenized input command issued by the user
-char *cmd_args[MAXARGS];
+    ctx->cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(ctx->cwd_fd < 0) {
+        free(ctx);
+        return NULL;
+    }
 
-// stores the last command issued by the user
-char last_command[MAXLINE];
-char curr_command[MAXLINE];
+    ctx->stdin_fd = STDIN_FILENO;
+    ctx->stdout_fd = STDOUT_FILENO;
+    ctx->stderr_fd = STDERR_FILENO;
+    ctx->out = ctx->stdout_fd;
+    ctx->redirect_open_fd = -1;
+    ctx->job_cpu = -1;
 
-// redirection
-bool redirect_append = false;
+    clear_redirection_vars(ctx);
 
-bool redirect_in = false;
-bool redirect_out = false;
-bool redirect_err = false;
+    for(int i = 0 ; environ != NULL && environ[i] != NULL ; i++) {
+        if(setEnv(ctx, environ[i]) == -1) {
+            wsh_ctx_free(ctx);
+            return NULL;
+        }
+    }
 
-int orig_stdn;
-int orig_stdin;
-int orig_stderr;
+    // we need to set PATH to /bin initially
+    if(setEnv(ctx, "PATH=/bin") == -1) {
+        wsh_ctx_free(ctx);
+        return NULL;
+    }
 
-char *redirect_filename = NULL;
-int redirect_fd = -1;
+    return ctx;
+}
 
-// error executing cmds
-bool is_err = false;
 
-char path_global[4096];
+void wsh_ctx_free(wsh_ctx *ctx) {
+    if(ctx == NULL) return;
 
-// for batch mode
-char *line = NULL;
-FILE *batch_file = NULL;
+    free_memory(ctx);
+    free(ctx);
+}
 
-// history_cmd
-char history_cmd[MAXLINE];
 
+static void free_memory(wsh_ctx *ctx) {
+    wsh_out_flush(ctx);
+    wsh_free(ctx, ctx->outbuf);
+    ctx->outbuf = NULL;
 
-void free_memory(void) {
     // Free History
-    HistNode *histPtr = histHead;
+    HistNode *histPtr = ctx->histHead;
     while(histPtr != NULL) {
         HistNode *h = histPtr;
         histPtr = histPtr->next;
 
-        free(h);
+        wsh_free(ctx, h);
     }
+    wsh_free(ctx, ctx->hist_buckets);
+    ctx->hist_buckets = NULL;
+    ctx->hist_nbuckets = 0;
+    freeHistIndex(ctx);
+    ctx->histHead = NULL;
+    ctx->histTail = NULL;
+    ctx->curr_history_size = 0;
 
     // Free Local
-    LocalNode *localPtr = localHead;
+    LocalNode *localPtr = ctx->localHead;
     while(localPtr != NULL) {
         LocalNode *l = localPtr;
         localPtr = localPtr->next;
         
-        free(l->varname);
-        free(l->varvalue);
-        free(l);
+        wsh_free(ctx, l->varname);
+        wsh_free(ctx, l->varvalue);
+        wsh_free(ctx, l);
+    }
+    ctx->localHead = NULL;
+
+    // Free Environment
+    for(int i = 0 ; i < ctx->env_len ; i++) {
+        wsh_free(ctx, ctx->env[i]);
+    }
+    wsh_free(ctx, ctx->env);
+    ctx->env = NULL;
+    ctx->env_len = 0;
+    ctx->env_cap = 0;
+
+    for(int i = 0 ; i < MAXARGS ; i++) {
+        wsh_free(ctx, ctx->expanded_args[i]);
+        ctx->expanded_args[i] = NULL;
+    }
+
+    wsh_free(ctx, ctx->last_command);
+    wsh_free(ctx, ctx->curr_command);
+    wsh_free(ctx, ctx->line_buf);
+    wsh_free(ctx, ctx->history_cmd);
+    ctx->last_command = NULL;
+    ctx->curr_command = NULL;
+    ctx->line_buf = NULL;
+    ctx->history_cmd = NULL;
+    ctx->last_command_cap = 0;
+    ctx->curr_command_cap = 0;
+    ctx->line_buf_cap = 0;
+    ctx->history_cmd_cap = 0;
+
+    if(ctx->redirect_open_fd != -1) close(ctx->redirect_open_fd);
+    ctx->redirect_open_fd = -1;
+
+    reap_procsubs(ctx);
+    profile_free(ctx);
+
+    wsh_free(ctx, ctx->heredoc_body);
+    ctx->heredoc_body = NULL;
+    ctx->heredoc_len = 0;
+    ctx->heredoc_cap = 0;
+
+    if(ctx->cwd_fd != -1) close(ctx->cwd_fd);
+    ctx->cwd_fd = -1;
+}
+
+
+/**
+ * Writes the whole iovec to fd, a short write continues where it stopped
+ */
+static int writeAll(int fd, struct iovec *iov, int iovcnt) {
+    while(iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        while(iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Output layer of the built-ins
+ * Everything they print is collected in outbuf and written to ctx->out with large writes,
+ * the buffer is flushed before every fork and whenever ctx->out changes
+ */
+int wsh_out_flush(wsh_ctx *ctx) {
+    if(ctx->outbuf_len == 0) return 0;
+
+    struct iovec iov = {ctx->outbuf, ctx->outbuf_len};
+    ctx->outbuf_len = 0;
+
+    return writeAll(ctx->out, &iov, 1);
+}
+
+
+/**
+ * Appends len bytes to the output, data that doesn't fit goes out in the same writev as the buffer
+ */
+static int out_write(wsh_ctx *ctx, const char *data, size_t len) {
+    if(len == 0) return 0;
+
+    if(ctx->outbuf == NULL) {
+        ctx->outbuf = wsh_malloc(ctx, MEM_IO, OUTBUF_SIZE);
+        if(ctx->outbuf == NULL) {
+            struct iovec iov = {(char*) data, len};
+            return writeAll(ctx->out, &iov, 1);
+        }
+    }
+
+    if(len <= OUTBUF_SIZE - ctx->outbuf_len) {
+        memcpy(ctx->outbuf + ctx->outbuf_len, data, len);
+        ctx->outbuf_len += len;
+        return 0;
     }
 
-    if(batch_file != NULL) fclose(batch_file);
-    if(line != NULL) free(line);
+    struct iovec iov[2] = {{ctx->outbuf, ctx->outbuf_len}, {(char*) data, len}};
+    ctx->outbuf_len = 0;
+
+    return writeAll(ctx->out, iov, 2);
+}
+
 
+static int out_printf(wsh_ctx *ctx, const char *fmt, ...) {
+    char line[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if(n < 0) return -1;
+    if((size_t) n < sizeof(line)) return out_write(ctx, line, n);
+
+    // longer than the line buffer, format it again into a block of the right size
+    char *long_line = wsh_malloc(ctx, MEM_IO, n + 1);
+    if(long_line == NULL) return -1;
+
+    va_start(ap, fmt);
+    vsnprintf(long_line, n + 1, fmt, ap);
+    va_end(ap);
+
+    int rc = out_write(ctx, long_line, n);
+    wsh_free(ctx, long_line);
+
+    return rc;
 }
 
 
@@ -85,9 +475,9 @@ void free_memory(void) {
  * Counts number of args in cmd_args
  * Ignore the first item which is the actual command
  */
-int count_cmd_args(void) {
+static int count_cmd_args(wsh_ctx *ctx) {
     int cmd_args_count = 0;
-    for(int i = 1 ; cmd_args[i] != NULL ; i++) {
+    for(int i = 1 ; ctx->cmd_args[i] != NULL ; i++) {
         cmd_args_count++;
     }
 
@@ -95,12 +485,111 @@ int count_cmd_args(void) {
 }
 
 
-char * getVarValue(char *var_name) {
-    if(getenv(var_name) != NULL) {
-        return getenv(var_name);
+/**
+ * Copies len bytes of src into the growable buffer *dst and NUL terminates it
+ * The buffer starts at MAXLINE and doubles so long commands don't get truncated
+ */
+static int setString(wsh_ctx *ctx, char **dst, size_t *cap, const char *src, size_t len) {
+    if(*dst == NULL || len + 1 > *cap) {
+        size_t new_cap = *cap == 0 ? MAXLINE : *cap;
+        while(new_cap < len + 1) new_cap *= 2;
+
+        char *new_dst = wsh_realloc(ctx, MEM_PARSE, *dst, new_cap);
+        if(new_dst == NULL) return -1;
+
+        *dst = new_dst;
+        *cap = new_cap;
+    }
+
+    memmove(*dst, src, len);
+    (*dst)[len] = '\0';
+
+    return 0;
+}
+
+
+/**
+ * Looks up var_name in the environment of the session
+ */
+static char * getEnv(wsh_ctx *ctx, const char *var_name) {
+    size_t name_len = strlen(var_name);
+
+    for(int i = 0 ; i < ctx->env_len ; i++) {
+        if(strncmp(ctx->env[i], var_name, name_len) == 0 && ctx->env[i][name_len] == '=') {
+            return ctx->env[i] + name_len + 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Gets an assignment in the form varname=varvalue and sets it in the environment of the session
+ * The env array is always kept NULL terminated so it can be handed to the children as is
+ */
+static int setEnv(wsh_ctx *ctx, const char *assignment) {
+    char *eq = strchr(assignment, '=');
+    if(eq == NULL || eq == assignment) return -1;
+
+    size_t name_len = eq - assignment + 1;
+
+    char *entry = wsh_strdup(ctx, MEM_ENV, assignment);
+    if(entry == NULL) return -1;
+
+    for(int i = 0 ; i < ctx->env_len ; i++) {
+        if(strncmp(ctx->env[i], assignment, name_len) == 0) {
+            wsh_free(ctx, ctx->env[i]);
+            ctx->env[i] = entry;
+            envChanged(ctx, entry);
+            return 0;
+        }
+    }
+
+    if(ctx->env_len + 1 >= ctx->env_cap) {
+        int new_cap = ctx->env_cap == 0 ? 64 : ctx->env_cap * 2;
+        char **new_env = (char**) wsh_realloc(ctx, MEM_ENV, ctx->env, new_cap * sizeof(char*));
+        if(new_env == NULL) {
+            wsh_free(ctx, entry);
+            return -1;
+        }
+        ctx->env = new_env;
+        ctx->env_cap = new_cap;
+    }
+
+    ctx->env[ctx->env_len++] = entry;
+    ctx->env[ctx->env_len] = NULL;
+    envChanged(ctx, entry);
+
+    return 0;
+}
+
+
+/**
+ * Keeps the settings the shell reads from its environment in sync with a variable that was just set
+ */
+static void envChanged(wsh_ctx *ctx, const char *assignment) {
+    const char *value = strchr(assignment, '=') + 1;
+
+    if(strncmp(assignment, "WSH_CPUSET=", 11) == 0) {
+        ctx->default_cpu_mask_set = strlen(value) > 0 && parse_cpulist(value, ctx->default_cpu_mask) == 0;
+    }
+    else if(strncmp(assignment, "histcontrol=", 12) == 0) {
+        updateHistControl(ctx);
+    }
+}
+
+
+static char * getVarValue(wsh_ctx *ctx, char *var_name) {
+    if(strcmp(var_name, "?") == 0) {
+        snprintf(ctx->last_status_buf, sizeof(ctx->last_status_buf), "%d", ctx->last_status);
+        return ctx->last_status_buf;
+    }
+    else if(getEnv(ctx, var_name) != NULL) {
+        return getEnv(ctx, var_name);
     } 
-    else if(searchLocal(var_name) != NULL) {
-        return searchLocal(var_name);
+    else if(searchLocal(ctx, var_name) != NULL) {
+        return searchLocal(ctx, var_name);
     }
 
     return "";
@@ -109,45 +598,46 @@ char * getVarValue(char *var_name) {
 
 /**
  * If there are any variables in the args list then we replace it by their corresponding value
+ * The values are copied into expanded_args since they might not fit in place of the token
  */
-int replace_vars(void) {
+static int replace_vars(wsh_ctx *ctx) {
 
-    for(int i = 0 ; cmd_args[i] != NULL ; i++) {
+    for(int i = 0 ; ctx->cmd_args[i] != NULL ; i++) {
         // case when token starts with a $ so a general variable case
         // eg: cd $files backup
-        if(cmd_args[i][0] == '$') {
+        if(ctx->cmd_args[i][0] == '$') {
             // if a token starts with '$' but also has a '=' in it then it means $a=b
             // which is an invalid case
-            if(strstr(cmd_args[i], "=") != NULL) {
-                is_err = true;
+            if(strstr(ctx->cmd_args[i], "=") != NULL) {
+                ctx->is_err = true;
+                return -1;
+            }
+            char *var_name = ctx->cmd_args[i] + 1;
+            ctx->expanded_args[i] = wsh_strdup(ctx, MEM_PARSE, getVarValue(ctx, var_name));
+            if(ctx->expanded_args[i] == NULL) {
+                ctx->is_err = true;
                 return -1;
             }
-            char *var_name = cmd_args[i] + 1;
-            strcpy(cmd_args[i], getVarValue(var_name));
+            ctx->cmd_args[i] = ctx->expanded_args[i];
         }
         // handles case when $ is somewhere in the token
         // so a variable assignment case like a=$b
         // assumption works since it's guaranteed that variables will be single tokens
-        else if(strstr(cmd_args[i], "=$") != NULL) {
-            char *var_name = strchr(cmd_args[i], '$') + 1;
-            char *var_val = getVarValue(var_name);
-
-            char new_token[strlen(cmd_args[i]) + strlen(var_val) + 1];
-            int k = 0;
-            while(cmd_args[i][k] != '$') {
-                new_token[k] = cmd_args[i][k];
-                k++;
-            }
-
-            int j = 0;
-            while(j <= (int)strlen(var_val) && var_val[j] != '\0') {
-                new_token[k] = var_val[j];
-                k++;
-                j++;
+        else if(strstr(ctx->cmd_args[i], "=$") != NULL) {
+            char *dollar = strchr(ctx->cmd_args[i], '$');
+            char *var_val = getVarValue(ctx, dollar + 1);
+            size_t prefix_len = dollar - ctx->cmd_args[i];
+
+            char *new_token = wsh_malloc(ctx, MEM_PARSE, prefix_len + strlen(var_val) + 1);
+            if(new_token == NULL) {
+                ctx->is_err = true;
+                return -1;
             }
-            new_token[k] = '\0';
+            memcpy(new_token, ctx->cmd_args[i], prefix_len);
+            strcpy(new_token + prefix_len, var_val);
 
-            strcpy(cmd_args[i], new_token);
+            ctx->expanded_args[i] = new_token;
+            ctx->cmd_args[i] = new_token;
         }
     }
 
@@ -159,12 +649,12 @@ int replace_vars(void) {
  * Prints the history pointed by HEAD
  * The history LL ends with a NULL so it's prints till NULL is encoutered
  */
-void printHistory(void) {
-    HistNode *ptr = histHead;
+static void printHistory(wsh_ctx *ctx) {
+    HistNode *ptr = ctx->histHead;
     
     int i = 1;
     while(ptr != NULL) {
-        printf("%d) %s\n", i, ptr->cmd);
+        out_printf(ctx, "%d) %s\n", i, ptr->cmd);
         i++;
         ptr = ptr->next;
     }
@@ -174,8 +664,8 @@ void printHistory(void) {
 /**
  * Checks for a given index value in the History LL
  */
-char * searchHistory(int target_idx) {
-    HistNode *ptr = histHead;
+static char * searchHistory(wsh_ctx *ctx, int target_idx) {
+    HistNode *ptr = ctx->histHead;
     while(target_idx > 1) {
         ptr = ptr->next;
         target_idx--;
@@ -186,239 +676,568 @@ char * searchHistory(int target_idx) {
 
 
 /**
- * Adds a NON built-in and NON history executed command into the History
- * If overflow then truncate old commands in the history
+ * FNV-1a hash of a command, used by the history set
  */
-void addToHistory(void) {
-    HistNode *NN = (HistNode*) malloc(sizeof(HistNode));
-    NN->prev = NULL;
-    NN->next = NULL;
-    strcpy(NN->cmd, curr_command);
-
-    if(histHead == NULL && histTail == NULL) {
-        histHead = NN;
-        histTail = NN;
-        curr_history_size += 1;
-        return;
+static unsigned long hashString(const char *str) {
+    unsigned long hash = 14695981039346656037UL;
+    for(const unsigned char *p = (const unsigned char *) str ; *p != '\0' ; p++) {
+        hash ^= *p;
+        hash *= 1099511628211UL;
     }
 
-    histHead->prev = NN;
-    NN->next = histHead;
-    histHead = NN;
+    return hash;
+}
 
-    if(curr_history_size >= history_capacity) {
-        HistNode *t = histTail;
-        histTail = histTail->prev;
-        histTail->next = NULL;
 
-        free(t);
-    } else {
-        curr_history_size += 1;
+/**
+ * FNV-1a over len bytes, continuing from hash so a long input can be hashed in pieces
+ */
+static unsigned long hashBytes(unsigned long hash, const void *data, size_t len) {
+    for(const unsigned char *p = data ; p < (const unsigned char *) data + len ; p++) {
+        hash ^= *p;
+        hash *= 1099511628211UL;
     }
 
+    return hash;
 }
 
 
 /**
- * Update the history capacity to new_hist_capacity
- * (I) if we are shrinking the capacity then we need to think about different cases
- * Case 1: curr_hist_size >= new_hist_size - means we have more history then we can fit so delete
-   in this case delete curr_hist_size - new_hist_capacity nodes from the end
- * 
- * Case 2: curr_hist_size < new_hist_size
-   in this case we don't do anything, just simply update the hist_capacticy size
- * 
- * (II) if the new capacity is greater than the old capacity then just update the hist_capacity variable
- * 
- * (III) if the new and old hist capacities are the same then don't do anything
+ * Returns the history entry holding cmd, NULL if there is none
  */
-void updateHistoryCapacity(int new_hist_capacity) {
-    
-    if(new_hist_capacity == 0) {
-        histHead = NULL;
-        histTail = NULL;
-        history_capacity = new_hist_capacity;
-        curr_history_size = 0;
+static HistNode * findHistory(wsh_ctx *ctx, const char *cmd, unsigned long hash) {
+    if(ctx->hist_nbuckets == 0) return NULL;
+
+    HistNode *ptr = ctx->hist_buckets[hash & (ctx->hist_nbuckets - 1)];
+    while(ptr != NULL) {
+        if(ptr->hash == hash && strcmp(ptr->cmd, cmd) == 0) return ptr;
+        ptr = ptr->hnext;
     }
-    
-    if(new_hist_capacity < history_capacity && curr_history_size > new_hist_capacity) {
 
-        int nodesToDelete = curr_history_size - new_hist_capacity;
+    return NULL;
+}
+
 
-        while(nodesToDelete > 0) {
-            HistNode *t = histTail;
-            histTail = histTail->prev;
-            histTail->next = NULL;
+/**
+ * Adds NN to the hash set of the history, the buckets double once there are more entries than buckets
+ */
+static void histSetInsert(wsh_ctx *ctx, HistNode *NN) {
+    if((unsigned long) ctx->curr_history_size + 1 > ctx->hist_nbuckets) {
+        unsigned long new_nbuckets = ctx->hist_nbuckets == 0 ? 64 : ctx->hist_nbuckets * 2;
+        HistNode **new_buckets = (HistNode**) wsh_calloc(ctx, MEM_HISTORY, new_nbuckets, sizeof(HistNode*));
+
+        if(new_buckets != NULL) {
+            for(unsigned long i = 0 ; i < ctx->hist_nbuckets ; i++) {
+                HistNode *ptr = ctx->hist_buckets[i];
+                while(ptr != NULL) {
+                    HistNode *next = ptr->hnext;
+                    ptr->hnext = new_buckets[ptr->hash & (new_nbuckets - 1)];
+                    new_buckets[ptr->hash & (new_nbuckets - 1)] = ptr;
+                    ptr = next;
+                }
+            }
 
-            free(t);
-            nodesToDelete -= 1;
+            wsh_free(ctx, ctx->hist_buckets);
+            ctx->hist_buckets = new_buckets;
+            ctx->hist_nbuckets = new_nbuckets;
         }
-        curr_history_size = new_hist_capacity;
     }
-    
-    history_capacity = new_hist_capacity;
+
+    HistNode **bucket = &ctx->hist_buckets[NN->hash & (ctx->hist_nbuckets - 1)];
+    NN->hnext = *bucket;
+    *bucket = NN;
+}
+
+
+static void histSetRemove(wsh_ctx *ctx, HistNode *node) {
+    HistNode **ptr = &ctx->hist_buckets[node->hash & (ctx->hist_nbuckets - 1)];
+    while(*ptr != node) {
+        ptr = &(*ptr)->hnext;
+    }
+
+    *ptr = node->hnext;
 }
 
 
 /**
- * Executes the history command
- * 1) history - prints the history
- * 2) history set n - updates history capactiy to n
- * 3) history n - executes the nth command in the history
+ * Bucket of a trigram in the search index
  */
-int history(bool *is_from_history) {
+static unsigned int trigramBucket(const char *p) {
+    unsigned int trigram = ((unsigned char) p[0] << 16) | ((unsigned char) p[1] << 8) | (unsigned char) p[2];
+    return (trigram * 2654435761U) >> (32 - HIST_INDEX_BITS);
+}
 
-    // Built-In history command
-    if(cmd_args[1] == NULL) {
-        // print the history
-        printHistory();
+
+static void fenwickAdd(HistIndex *index, unsigned long seq, int delta) {
+    for(unsigned long i = seq + 1 ; i <= index->seq_cap ; i += i & (~i + 1)) {
+        index->fenwick[i] += delta;
     }
+}
 
-    // if history set # command is executed - update history size
-    else if(strcmp(cmd_args[1], "set") == 0) {
-        if(!isdigit(cmd_args[2][0])) {
-            is_err = true;
-            return -1;
-        }
-        
-        int new_hist_capactiy = atoi(cmd_args[2]);
-        if(new_hist_capactiy >= 0) {
-            updateHistoryCapacity(new_hist_capactiy);
-        } else {
-            is_err = true;
-            return -1;
-        }
+
+/**
+ * Number of live entries with a seq <= seq
+ */
+static int fenwickSum(HistIndex *index, unsigned long seq) {
+    int sum = 0;
+    for(unsigned long i = seq + 1 ; i > 0 ; i -= i & (~i + 1)) {
+        sum += index->fenwick[i];
     }
 
-    else {
-        // check cmd_args[1] is a valid integer
-        *is_from_history = true;
+    return sum;
+}
 
-        if(!isdigit(cmd_args[1][0])) {
-            is_err = true;
-            return -1;
-        }
 
-        int hist_idx = atoi(cmd_args[1]);
-        if(hist_idx > 0 && hist_idx <= curr_history_size) {
-            char *hist_cmd = searchHistory(hist_idx);
-            
-            strcpy(history_cmd, hist_cmd);
-            parse_cmd(history_cmd);
-            
-            set_redirection();
-            run_cmd();
-            unset_redirection();
+/**
+ * Adds the postings of node to the search index
+ * Every bucket gets the seq of the node once, even if the command repeats a trigram
+ */
+static int indexHistNode(wsh_ctx *ctx, HistNode *node) {
+    HistIndex *index = ctx->hist_index;
+
+    // no room left for the seq, renumbering also picks up this node
+    if(node->seq >= index->seq_cap) return buildHistIndex(ctx);
+
+    index->by_seq[node->seq] = node;
+    fenwickAdd(index, node->seq, 1);
+    index->live++;
+
+    size_t len = strlen(node->cmd);
+    for(size_t i = 0 ; i + 3 <= len ; i++) {
+        PostingList *list = &index->lists[trigramBucket(node->cmd + i)];
+        if(list->len > 0 && list->seqs[list->len - 1] == node->seq) continue;
+
+        if(list->len == list->cap) {
+            unsigned int new_cap = list->cap == 0 ? 4 : list->cap * 2;
+            unsigned long *new_seqs = wsh_realloc(ctx, MEM_HISTORY, list->seqs, new_cap * sizeof(unsigned long));
+            if(new_seqs == NULL) return -1;
+
+            list->seqs = new_seqs;
+            list->cap = new_cap;
         }
+        list->seqs[list->len++] = node->seq;
     }
 
     return 0;
 }
 
 
-int exclude_hidden_files(const struct dirent *entry) {
-    return (entry->d_name[0] != '.');
-}
-
 /**
- * Custom Implementation of ls -1 command
+ * (Re)builds the search index from the history LL
+ * The entries are renumbered oldest first so the seqs stay dense, postings of removed entries are dropped
  */
-int ls(void) {
-    char pwd[PATH_MAX];
-    if(count_cmd_args() != 0) {
-        is_err = true;
-        return -1;
+static int buildHistIndex(wsh_ctx *ctx) {
+    if(ctx->hist_index == NULL) {
+        ctx->hist_index = (HistIndex*) wsh_calloc(ctx, MEM_HISTORY, 1, sizeof(HistIndex));
+        if(ctx->hist_index == NULL) return -1;
+    }
+
+    HistIndex *index = ctx->hist_index;
+    for(int i = 0 ; i < HIST_INDEX_BUCKETS ; i++) {
+        index->lists[i].len = 0;
     }
 
-    if(getcwd(pwd, sizeof(pwd)) == NULL) {
+    unsigned long new_cap = 2 * (unsigned long) ctx->curr_history_size + 1024;
+    HistNode **by_seq = (HistNode**) wsh_realloc(ctx, MEM_HISTORY, index->by_seq, new_cap * sizeof(HistNode*));
+    int *fenwick = (int*) wsh_realloc(ctx, MEM_HISTORY, index->fenwick, (new_cap + 1) * sizeof(int));
+    if(by_seq != NULL) index->by_seq = by_seq;
+    if(fenwick != NULL) index->fenwick = fenwick;
+    if(by_seq == NULL || fenwick == NULL) {
+        freeHistIndex(ctx);
         return -1;
     }
-    
-    struct dirent **allFileNames; 
-    int n = scandir(pwd, &allFileNames, exclude_hidden_files, alphasort);
 
-    if(n > 0) {
-        int i = 0;  
-        while(i < n) {
-            printf("%s\n", allFileNames[i]->d_name);
-            free(allFileNames[i]);
-            i++;
+    memset(index->by_seq, 0, new_cap * sizeof(HistNode*));
+    memset(index->fenwick, 0, (new_cap + 1) * sizeof(int));
+    index->seq_cap = new_cap;
+    index->live = 0;
+    index->dead = 0;
+
+    ctx->hist_next_seq = 0;
+    for(HistNode *ptr = ctx->histTail ; ptr != NULL ; ptr = ptr->prev) {
+        ptr->seq = ctx->hist_next_seq++;
+        if(indexHistNode(ctx, ptr) == -1) {
+            freeHistIndex(ctx);
+            return -1;
         }
-        free(allFileNames);
     }
 
     return 0;
 }
 
 
-/**
- * Custom implementation of cd command
- */
-int cd(void) {
-    if(cmd_args[1] == NULL) return -1;
+static void freeHistIndex(wsh_ctx *ctx) {
+    HistIndex *index = ctx->hist_index;
+    if(index == NULL) return;
 
-    if(count_cmd_args() != 1) {
-        is_err = true;
-        return -1;
-    }
-    
-    if(chdir(cmd_args[1]) != 0) {
-        is_err = true;
-        return -1;
+    for(int i = 0 ; i < HIST_INDEX_BUCKETS ; i++) {
+        wsh_free(ctx, index->lists[i].seqs);
     }
+    wsh_free(ctx, index->by_seq);
+    wsh_free(ctx, index->fenwick);
+    wsh_free(ctx, index);
 
-    return 0;
+    ctx->hist_index = NULL;
 }
 
 
 /**
- * Gets cmd args in the form varname=varvalue
- * Sets this in the current processes environment variable
+ * Unlinks node from the history LL, the hash set and the search index and frees it
  */
-int export(void) {
-    if(count_cmd_args() != 1) {
-        return -1;
+static void removeHistNode(wsh_ctx *ctx, HistNode *node) {
+    if(node->prev != NULL) node->prev->next = node->next;
+    else ctx->histHead = node->next;
+
+    if(node->next != NULL) node->next->prev = node->prev;
+    else ctx->histTail = node->prev;
+
+    ctx->curr_history_size -= 1;
+    histSetRemove(ctx, node);
+
+    HistIndex *index = ctx->hist_index;
+    if(index != NULL) {
+        index->by_seq[node->seq] = NULL;
+        fenwickAdd(index, node->seq, -1);
+        index->live--;
+        index->dead++;
     }
 
-    // if 2nd token in command doesn't contain an '=' then it's an error
-    if(strstr(cmd_args[1], "=") == NULL) {
-        is_err = true;
-        return -1;
-    }
-    
-    strcpy(path_global, cmd_args[1]);
-    putenv(path_global);
-    return 0;
+    wsh_free(ctx, node);
+
+    // drop the postings of removed entries once they outnumber the live ones
+    if(index != NULL && index->dead > index->live + 1024) buildHistIndex(ctx);
 }
 
 
 /**
- * Prints the local variables LL pointed by localHead
+ * Reads histcontrol once when it is set so adding an entry doesn't have to look it up
  */
-int vars(void) {
+static void updateHistControl(wsh_ctx *ctx) {
+    ctx->hist_erasedups = strstr(getVarValue(ctx, "histcontrol"), "erasedups") != NULL;
+}
 
-    if(count_cmd_args() != 0) {
-        is_err = true;
-        return -1;
+
+/**
+ * Adds cmd as the newest entry of the History
+ * If overflow then truncate old commands in the history
+ * With histcontrol=erasedups an older copy of the command is removed first
+ */
+static void addHistoryEntry(wsh_ctx *ctx, const char *cmd) {
+    if(ctx->history_capacity == 0) return;
+
+    unsigned long hash = hashString(cmd);
+
+    if(ctx->hist_erasedups) {
+        HistNode *dup = findHistory(ctx, cmd, hash);
+        if(dup != NULL) removeHistNode(ctx, dup);
     }
 
-    if(localHead == NULL) return 0;
-    LocalNode *ptr = localHead;
-    
-    while(ptr != NULL) {
-        if(ptr->varvalue != NULL) printf("%s=%s\n", ptr->varname, ptr->varvalue);
-        ptr = ptr->next;
+    size_t cmd_len = strlen(cmd);
+    HistNode *NN = (HistNode*) wsh_malloc(ctx, MEM_HISTORY, sizeof(HistNode) + cmd_len + 1);
+    if(NN == NULL) return;
+
+    NN->prev = NULL;
+    NN->next = ctx->histHead;
+    NN->hash = hash;
+    NN->seq = ctx->hist_next_seq++;
+    memcpy(NN->cmd, cmd, cmd_len + 1);
+
+    if(ctx->histHead != NULL) ctx->histHead->prev = NN;
+    else ctx->histTail = NN;
+    ctx->histHead = NN;
+
+    histSetInsert(ctx, NN);
+    ctx->curr_history_size += 1;
+
+    if(ctx->hist_index != NULL && indexHistNode(ctx, NN) == -1) freeHistIndex(ctx);
+
+    if(ctx->curr_history_size > ctx->history_capacity) {
+        removeHistNode(ctx, ctx->histTail);
     }
 
-    return 0;
+}
+
+
+/**
+ * Adds a NON built-in and NON history executed command into the History
+ */
+static void addToHistory(wsh_ctx *ctx) {
+    addHistoryEntry(ctx, ctx->curr_command);
+}
+
+
+/**
+ * Update the history capacity to new_hist_capacity
+ * (I) if we are shrinking the capacity then we need to think about different cases
+ * Case 1: curr_hist_size >= new_hist_size - means we have more history then we can fit so delete
+   in this case delete curr_hist_size - new_hist_capacity nodes from the end
+ * 
+ * Case 2: curr_hist_size < new_hist_size
+   in this case we don't do anything, just simply update the hist_capacticy size
+ * 
+ * (II) if the new capacity is greater than the old capacity then just update the hist_capacity variable
+ * 
+ * (III) if the new and old hist capacities are the same then don't do anything
+ */
+static void updateHistoryCapacity(wsh_ctx *ctx, int new_hist_capacity) {
+    
+    while(ctx->curr_history_size > new_hist_capacity) {
+        removeHistNode(ctx, ctx->histTail);
+    }
+    
+    ctx->history_capacity = new_hist_capacity;
+}
+
+
+/**
+ * Prints the history entries containing pattern, newest first and numbered like printHistory
+ * Patterns of 3 or more characters are looked up in the trigram index, which is built on the first
+ * search and kept up to date by every insert after that
+ * The candidates come from the shortest posting list among the trigrams of the pattern
+ */
+static int historySearch(wsh_ctx *ctx, const char *pattern) {
+    size_t len = strlen(pattern);
+
+    if(len < 3 || (ctx->hist_index == NULL && buildHistIndex(ctx) == -1)) {
+        int i = 1;
+        for(HistNode *ptr = ctx->histHead ; ptr != NULL ; ptr = ptr->next, i++) {
+            if(strstr(ptr->cmd, pattern) != NULL) out_printf(ctx, "%d) %s\n", i, ptr->cmd);
+        }
+        return 0;
+    }
+
+    HistIndex *index = ctx->hist_index;
+    PostingList *best = NULL;
+    for(size_t i = 0 ; i + 3 <= len ; i++) {
+        PostingList *list = &index->lists[trigramBucket(pattern + i)];
+        if(best == NULL || list->len < best->len) best = list;
+    }
+
+    for(unsigned int i = best->len ; i > 0 ; i--) {
+        unsigned long seq = best->seqs[i - 1];
+        HistNode *node = index->by_seq[seq];
+
+        // removed entry or a different trigram in the same bucket
+        if(node == NULL || strstr(node->cmd, pattern) == NULL) continue;
+
+        int hist_idx = (int) index->live - fenwickSum(index, seq) + 1;
+        out_printf(ctx, "%d) %s\n", hist_idx, node->cmd);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Executes the history command
+ * 1) history - prints the history
+ * 2) history set n - updates history capactiy to n
+ * 3) history n - executes the nth command in the history
+ * 4) history search pattern - prints the entries containing pattern
+ */
+static int history(wsh_ctx *ctx, bool *is_from_history) {
+
+    // Built-In history command
+    if(ctx->cmd_args[1] == NULL) {
+        // print the history
+        printHistory(ctx);
+    }
+
+    // if history set # command is executed - update history size
+    else if(strcmp(ctx->cmd_args[1], "set") == 0) {
+        if(ctx->cmd_args[2] == NULL || !isdigit(ctx->cmd_args[2][0])) {
+            ctx->is_err = true;
+            return -1;
+        }
+        
+        int new_hist_capactiy = atoi(ctx->cmd_args[2]);
+        if(new_hist_capactiy >= 0) {
+            updateHistoryCapacity(ctx, new_hist_capactiy);
+        } else {
+            ctx->is_err = true;
+            return -1;
+        }
+    }
+
+    else if(strcmp(ctx->cmd_args[1], "search") == 0) {
+        if(ctx->cmd_args[2] == NULL) {
+            ctx->is_err = true;
+            return -1;
+        }
+
+        // the pattern may span several tokens, they were split on single spaces
+        char pattern[4096] = "";
+        for(int i = 2 ; ctx->cmd_args[i] != NULL ; i++) {
+            if(i > 2) strncat(pattern, " ", sizeof(pattern) - strlen(pattern) - 1);
+            strncat(pattern, ctx->cmd_args[i], sizeof(pattern) - strlen(pattern) - 1);
+        }
+
+        historySearch(ctx, pattern);
+    }
+
+    else {
+        // check cmd_args[1] is a valid integer
+        *is_from_history = true;
+
+        if(!isdigit(ctx->cmd_args[1][0])) {
+            ctx->is_err = true;
+            return -1;
+        }
+
+        int hist_idx = atoi(ctx->cmd_args[1]);
+        if(hist_idx > 0 && hist_idx <= ctx->curr_history_size) {
+            char *hist_cmd = searchHistory(ctx, hist_idx);
+            
+            if(setString(ctx, &ctx->history_cmd, &ctx->history_cmd_cap, hist_cmd, strlen(hist_cmd)) == -1) {
+                ctx->is_err = true;
+                return -1;
+            }
+            // the command applies its own redirection, the file opened for history isn't handed to it
+            unset_redirection(ctx);
+            parse_cmd(ctx, ctx->history_cmd);
+
+            // a here-string is part of the line, the body of a here-document isn't kept in the history
+            if(ctx->heredoc_string && read_heredoc(ctx) == -1) {
+                ctx->is_err = true;
+                return -1;
+            }
+
+            // timeout 5 history 2 bounds the command, a shorter timeout of its own still applies
+            long timeout_ms = ctx->timeout_ms;
+            if(ctx->cmd_args[0] != NULL && parse_prefixes(ctx) == 0) {
+                if(timeout_ms > 0 && (ctx->timeout_ms == 0 || timeout_ms < ctx->timeout_ms)) ctx->timeout_ms = timeout_ms;
+
+                // its <(cmd) / >(cmd) run next to it like in exec_cmd
+                if(ctx->nprocsubs > 0 && start_procsubs(ctx) == -1) {
+                    if(ctx->last_status == 0) ctx->last_status = 1;
+                    ctx->is_err = true;
+                }
+                else {
+                    run_cmd(ctx);
+                }
+                reap_procsubs(ctx);
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+static int exclude_hidden_files(const struct dirent *entry) {
+    return (entry->d_name[0] != '.');
+}
+
+/**
+ * Custom Implementation of ls -1 command
+ */
+static int ls(wsh_ctx *ctx) {
+    if(count_cmd_args(ctx) != 0) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    struct dirent **allFileNames; 
+    int n = scandirat(ctx->cwd_fd, ".", &allFileNames, exclude_hidden_files, alphasort);
+
+    if(n < 0) {
+        return -1;
+    }
+
+    int i = 0;  
+    while(i < n) {
+        out_printf(ctx, "%s\n", allFileNames[i]->d_name);
+        free(allFileNames[i]);
+        i++;
+    }
+    free(allFileNames);
+
+    return 0;
+}
+
+
+/**
+ * Custom implementation of cd command
+ * The session keeps the new directory open and the children start in it
+ */
+static int cd(wsh_ctx *ctx) {
+    if(ctx->cmd_args[1] == NULL) return -1;
+
+    if(count_cmd_args(ctx) != 1) {
+        ctx->is_err = true;
+        return -1;
+    }
+    
+    int new_cwd_fd = openat(ctx->cwd_fd, ctx->cmd_args[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(new_cwd_fd < 0) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    close(ctx->cwd_fd);
+    ctx->cwd_fd = new_cwd_fd;
+
+    return 0;
+}
+
+
+/**
+ * Gets cmd args in the form varname=varvalue
+ * Sets this in the environment variables of the session
+ */
+static int export(wsh_ctx *ctx) {
+    if(count_cmd_args(ctx) != 1) {
+        return -1;
+    }
+
+    // if 2nd token in command doesn't contain an '=' then it's an error
+    if(strstr(ctx->cmd_args[1], "=") == NULL) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    // a cpu list that can't be parsed is refused here instead of failing every later command
+    unsigned long mask[CPU_MASK_WORDS];
+    if(strncmp(ctx->cmd_args[1], "WSH_CPUSET=", 11) == 0 && strlen(ctx->cmd_args[1]) > 11 && parse_cpulist(ctx->cmd_args[1] + 11, mask) == -1) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    if(setEnv(ctx, ctx->cmd_args[1]) == -1) {
+        ctx->is_err = true;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Prints the local variables LL pointed by localHead
+ */
+static int vars(wsh_ctx *ctx) {
+
+    if(count_cmd_args(ctx) != 0) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    if(ctx->localHead == NULL) return 0;
+    LocalNode *ptr = ctx->localHead;
+    
+    while(ptr != NULL) {
+        if(ptr->varvalue != NULL) out_printf(ctx, "%s=%s\n", ptr->varname, ptr->varvalue);
+        ptr = ptr->next;
+    }
+
+    return 0;
 }
 
 
 /**
  * Checks for a given index value in the History LL
  */
-char * searchLocal(char* varname) {
-    LocalNode *ptr = localHead;
+static char * searchLocal(wsh_ctx *ctx, char* varname) {
+    LocalNode *ptr = ctx->localHead;
     while(ptr != NULL) {
         if(strcmp(varname, ptr->varname) == 0) return ptr->varvalue;
         ptr = ptr->next;
@@ -428,22 +1247,23 @@ char * searchLocal(char* varname) {
 }
 
 
-int local(void) {
-    if(count_cmd_args() != 1) return -1;
+static int local(wsh_ctx *ctx) {
+    if(count_cmd_args(ctx) != 1) return -1;
 
     // local command can't start with a variable
     // local commands varname can't be empty
-    if(cmd_args[1][0] == '$' || cmd_args[1][0] == '=') {
-        is_err = true;
+    if(ctx->cmd_args[1][0] == '$' || ctx->cmd_args[1][0] == '=') {
+        ctx->is_err = true;
         return -1;
     }
 
     char *token;
+    char *saveptr = NULL;
     char *varname = NULL;
     char *varvalue = "\0";
 
     // first token
-    token = strtok(cmd_args[1], "=");
+    token = strtok_r(ctx->cmd_args[1], "=", &saveptr);
 
     int ct = 0;
     while(token != NULL) {
@@ -452,10 +1272,23 @@ int local(void) {
         else if(ct == 2) varvalue = token;
         else return -1;
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &saveptr);
+    }
+
+    if(setLocal(ctx, varname, varvalue) == -1) {
+        ctx->is_err = true;
+        return -1;
     }
 
-    LocalNode *ptr = localHead;
+    return 0;
+}
+
+
+/**
+ * Sets the local varname to varvalue, a new variable goes at the end of the list
+ */
+static int setLocal(wsh_ctx *ctx, const char *varname, const char *varvalue) {
+    LocalNode *ptr = ctx->localHead;
 
     while(ptr != NULL && ptr->next != NULL && strcmp(ptr->varname, varname) != 0) {
         ptr = ptr->next;
@@ -470,183 +1303,1884 @@ int local(void) {
      * 3. ptr is somewhere in middle which means match was found - UPDATE
      * */ 
     if(ptr == NULL || (ptr->next == NULL && strcmp(ptr->varname, varname) != 0)) {
-        LocalNode *LN = (LocalNode*) malloc(sizeof(LocalNode));
+        LocalNode *LN = (LocalNode*) wsh_malloc(ctx, MEM_LOCALS, sizeof(LocalNode));
+        if(LN == NULL) return -1;
         
-        LN->varname = malloc((strlen(varname)+1) * sizeof(char));
-        LN->varvalue = malloc((strlen(varvalue)+1) * sizeof(char));
+        LN->varname = wsh_malloc(ctx, MEM_LOCALS, (strlen(varname)+1) * sizeof(char));
+        LN->varvalue = wsh_malloc(ctx, MEM_LOCALS, (strlen(varvalue)+1) * sizeof(char));
+        if(LN->varname == NULL || LN->varvalue == NULL) {
+            wsh_free(ctx, LN->varname);
+            wsh_free(ctx, LN->varvalue);
+            wsh_free(ctx, LN);
+            return -1;
+        }
         strcpy(LN->varname, varname);
         strcpy(LN->varvalue, varvalue);
         LN->next = NULL;
 
-        if(ptr == NULL) localHead = LN;
+        if(ptr == NULL) ctx->localHead = LN;
         else {
             ptr->next = LN;
         }
     } else {
-        free(ptr->varvalue);
-        ptr->varvalue = malloc((strlen(varvalue)+1) * sizeof(char));
+        wsh_free(ctx, ptr->varvalue);
+        ptr->varvalue = wsh_malloc(ctx, MEM_LOCALS, (strlen(varvalue)+1) * sizeof(char));
+        if(ptr->varvalue == NULL) return -1;
         strcpy(ptr->varvalue, varvalue);
     }
 
-    free(token);
+    if(strcmp(varname, "histcontrol") == 0) updateHistControl(ctx);
 
     return 0;
 }
 
 
-int run_cmd(void) {
-    char cmd_path[4096] = "";
+/**
+ * Runs in the child between fork and execv
+ * Moves the session fds onto 0 1 2 and applies the redirection of the command
+ * Only async-signal-safe calls here since the embedder may have other threads running
+ */
+static int apply_redirection(wsh_ctx *ctx) {
+    if(ctx->stdin_fd != STDIN_FILENO && dup2(ctx->stdin_fd, STDIN_FILENO) < 0) return -1;
+    if(ctx->stdout_fd != STDOUT_FILENO && dup2(ctx->stdout_fd, STDOUT_FILENO) < 0) return -1;
+    if(ctx->stderr_fd != STDERR_FILENO && dup2(ctx->stderr_fd, STDERR_FILENO) < 0) return -1;
+
+    // the command reaches the pipes of its process substitutions through /dev/fd/N
+    for(int i = 0 ; i < ctx->nprocsubs ; i++) {
+        if(fcntl(ctx->procsubs[i].fd, F_SETFD, 0) < 0) return -1;
+    }
 
-    // accessing the arg0 passed by user directly may cause issues if a directory with name same as
-    // NON-built command exists
-    // Hence if a '/' exists in the user input command just execute it
+    if(ctx->redirect_out) {
+        // the children of a built-in share the file it opened, reopening it would truncate it for each
+        int output_fd = ctx->redirect_open_fd >= 0 ? dup(ctx->redirect_open_fd) : openat(ctx->cwd_fd, ctx->redirect_filename, O_WRONLY | O_CREAT | (ctx->redirect_append ? O_APPEND : O_TRUNC), 0644);
+        if(output_fd < 0) return -1;
 
-    if(strchr(cmd_args[0], '/') != NULL) {
-        strcpy(cmd_path, cmd_args[0]);
-    } else {
-        char *path_original = getenv("PATH");
-        char *path = strdup(path_original);
+        if(ctx->redirect_err && dup2(output_fd, STDERR_FILENO) < 0) return -1;
+        if(output_fd != ctx->redirect_fd) {
+            if(dup2(output_fd, ctx->redirect_fd) < 0) return -1;
+            close(output_fd);
+        }
+    }
 
-        char *token = strtok(path, ":");
-        
-        while(token != NULL) {
-            snprintf(cmd_path, sizeof(cmd_path), "%s/%s", token, cmd_args[0]);
-            if(access(cmd_path, X_OK) == 0) break;
+    if(ctx->redirect_heredoc) {
+        int input_fd = heredoc_open(ctx);
+        if(input_fd < 0) return -1;
+
+        if(dup2(input_fd, ctx->redirect_fd) < 0) return -1;
+        close(input_fd);
+    }
+    else if(ctx->redirect_in) {
+        int input_fd = openat(ctx->cwd_fd, ctx->redirect_filename, O_RDONLY);
+        if(input_fd < 0) return -1;
 
-            token = strtok(NULL, ":");
+        if(input_fd != ctx->redirect_fd) {
+            if(dup2(input_fd, ctx->redirect_fd) < 0) return -1;
+            close(input_fd);
         }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Built-In ulimit, the limits are only stored here and applied to the children
+ * 1) ulimit / ulimit -a - prints every limit the children get
+ * 2) ulimit -t - prints one limit
+ * 3) ulimit -t n / ulimit -t unlimited - sets the soft and hard limit of the children
+ */
+static int builtin_ulimit(wsh_ctx *ctx) {
+    int args = count_cmd_args(ctx);
+
+    if(args == 0 || (args == 1 && strcmp(ctx->cmd_args[1], "-a") == 0)) {
+        for(int i = 0 ; i < NLIMITS ; i++) {
+            struct rlimit rl;
+            rlim_t value = ctx->limits[i];
+            if(!ctx->limit_set[i]) {
+                getrlimit(limit_specs[i].resource, &rl);
+                value = rl.rlim_cur;
+            }
 
-        free(path);
+            if(value == RLIM_INFINITY) out_printf(ctx, "%-28s(-%c) unlimited\n", limit_specs[i].name, limit_specs[i].flag);
+            else out_printf(ctx, "%-28s(-%c) %llu\n", limit_specs[i].name, limit_specs[i].flag, (unsigned long long) (value / limit_specs[i].unit));
+        }
+        return 0;
     }
-    
-    if(strlen(cmd_path) == 0) {
-        is_err = true;
+
+    if(args > 2 || ctx->cmd_args[1][0] != '-' || strlen(ctx->cmd_args[1]) != 2) {
+        ctx->is_err = true;
         return -1;
     }
 
-    pid_t pid = fork();
-    
-    if(pid < 0) {
-        // fork itself failed
-        is_err = true;
+    int idx = -1;
+    for(int i = 0 ; i < NLIMITS ; i++) {
+        if(limit_specs[i].flag == ctx->cmd_args[1][1]) idx = i;
+    }
+    if(idx == -1) {
+        ctx->is_err = true;
         return -1;
     }
-    else if(pid == 0) {
-        // child process where we execute the command
-        execv(cmd_path, cmd_args);
-        
-        // if execv returned it means some error
-        // this error will be handled in the parent exit_status handler
-        exit(-1);
-    } else {
-        int status_ptr;
-        waitpid(pid, &status_ptr, 0);
-
-        // wifexited returns true if the child process exited normally
-        if(WIFEXITED(status_ptr)) {
-            // get exit status of the child process
-            int exit_status = WEXITSTATUS(status_ptr);
-            if(exit_status != 0) {
-                is_err = true;
-                return -1;
-            }
-        } else {
-            is_err = true;
+
+    if(args == 1) {
+        struct rlimit rl;
+        rlim_t value = ctx->limits[idx];
+        if(!ctx->limit_set[idx]) {
+            getrlimit(limit_specs[idx].resource, &rl);
+            value = rl.rlim_cur;
+        }
+
+        if(value == RLIM_INFINITY) out_printf(ctx, "unlimited\n");
+        else out_printf(ctx, "%llu\n", (unsigned long long) (value / limit_specs[idx].unit));
+        return 0;
+    }
+
+    rlim_t limit = RLIM_INFINITY;
+    if(strcmp(ctx->cmd_args[2], "unlimited") != 0) {
+        char *end;
+        errno = 0;
+        unsigned long long value = strtoull(ctx->cmd_args[2], &end, 10);
+
+        // RLIM_INFINITY itself can't be asked for as a number either
+        if(!isdigit(ctx->cmd_args[2][0]) || *end != '\0' || errno == ERANGE || value > (RLIM_INFINITY - 1) / limit_specs[idx].unit) {
+            ctx->is_err = true;
             return -1;
         }
+        limit = (rlim_t) value * limit_specs[idx].unit;
+    }
+
+    // a limit the children can't get would make every one of them fail in child_setup
+    if(checkLimit(limit_specs[idx].resource, limit) == -1) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    ctx->limits[idx] = limit;
+    ctx->limit_set[idx] = true;
+
+    return 0;
+}
+
+
+/**
+ * Checks that a child may set the soft and hard limit of resource to limit
+ * Only a privileged process can raise the hard limit, and no one gets more files than fs.nr_open
+ */
+static int checkLimit(int resource, rlim_t limit) {
+    struct rlimit rl;
+    if(getrlimit(resource, &rl) != 0) return -1;
+
+    if(limit > rl.rlim_max && geteuid() != 0) return -1;
+
+    if(resource == RLIMIT_NOFILE) {
+        if(limit == RLIM_INFINITY) return -1;
+
+        FILE *nr_open = fopen("/proc/sys/fs/nr_open", "re");
+        unsigned long long max_files = 0;
+        if(nr_open != NULL) {
+            if(fscanf(nr_open, "%llu", &max_files) != 1) max_files = 0;
+            fclose(nr_open);
+        }
+        if(max_files > 0 && limit > max_files) return -1;
     }
 
     return 0;
 }
 
 
-/**
- * Reads input from stdin and then stores it in the cmd_buf passed
- */
-int read_cmd(char *cmd, size_t cmd_sz) {
-    // fflush is used to immediately print the wsh> to stdout even if buffer isn't full
-    printf("wsh> ");
-    fflush(stdout);
+void wsh_print_stats(wsh_ctx *ctx) {
+    out_printf(ctx, "commands: %lu\n", ctx->stats.commands);
+    out_printf(ctx, "children: %lu\n", ctx->stats.children);
+    out_printf(ctx, "failures: %lu\n", ctx->stats.failures);
+    out_printf(ctx, "timeouts: %lu\n", ctx->stats.timeouts);
+}
+
+
+/**
+ * Prints the live bytes, peak bytes and number of allocations of every subsystem
+ */
+void wsh_print_mem(wsh_ctx *ctx) {
+    unsigned long allocs = 0;
+
+    out_printf(ctx, "%-10s %12s %12s %12s\n", "subsystem", "live", "peak", "allocs");
+    for(int i = 0 ; i < MEM_SUBSYSTEMS ; i++) {
+        out_printf(ctx, "%-10s %12ld %12ld %12lu\n", mem_names[i], ctx->mem[i].live, ctx->mem[i].peak, ctx->mem[i].allocs);
+        allocs += ctx->mem[i].allocs;
+    }
+    out_printf(ctx, "%-10s %12ld %12ld %12lu\n", "total", ctx->mem_live, ctx->mem_peak, allocs);
+}
+
+
+/**
+ * Prints the counters of the session
+ */
+static int stats(wsh_ctx *ctx) {
+    if(count_cmd_args(ctx) != 0) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    wsh_print_stats(ctx);
+
+    return 0;
+}
+
+
+/**
+ * Built-In mem, prints where the memory of the session goes
+ */
+static int mem(wsh_ctx *ctx) {
+    if(count_cmd_args(ctx) != 0) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    wsh_print_mem(ctx);
+
+    return 0;
+}
+
+
+/**
+ * Appends str to a snapshot at dst, NULL dst only measures it
+ */
+static size_t snapshot_put(char *dst, const char *str) {
+    uint32_t len = strlen(str);
+
+    if(dst != NULL) {
+        memcpy(dst, &len, sizeof(len));
+        memcpy(dst + sizeof(len), str, len + 1);
+    }
+
+    return sizeof(len) + len + 1;
+}
+
+
+/**
+ * Returns the next string of a snapshot, NULL if it runs past end or isn't NUL terminated
+ */
+static const char * snapshot_next(const char **pos, const char *end) {
+    uint32_t len;
+    if((size_t) (end - *pos) < sizeof(len)) return NULL;
+
+    memcpy(&len, *pos, sizeof(len));
+    const char *str = *pos + sizeof(len);
+    if((size_t) (end - str) <= len || str[len] != '\0') return NULL;
+
+    *pos = str + len + 1;
+    return str;
+}
+
+
+/**
+ * Writes the locals, the environment, the history and the cwd of the session to file_name
+ * The image is measured first and written with a single write into a temporary file that is
+ * renamed over file_name, so a reader never sees half a snapshot
+ */
+static int snapshot_save(wsh_ctx *ctx, const char *file_name) {
+    char cwd[PATH_MAX];
+    char fd_path[32];
+
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", ctx->cwd_fd);
+    ssize_t cwd_len = readlink(fd_path, cwd, sizeof(cwd) - 1);
+    if(cwd_len < 0) return -1;
+    cwd[cwd_len] = '\0';
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.history_capacity = ctx->history_capacity;
+    header.nenv = ctx->env_len;
+    header.nhist = ctx->curr_history_size;
+
+    size_t size = sizeof(header) + snapshot_put(NULL, cwd);
+    for(LocalNode *ptr = ctx->localHead ; ptr != NULL ; ptr = ptr->next) {
+        size += snapshot_put(NULL, ptr->varname) + snapshot_put(NULL, ptr->varvalue);
+        header.nlocals++;
+    }
+    for(int i = 0 ; i < ctx->env_len ; i++) size += snapshot_put(NULL, ctx->env[i]);
+    for(HistNode *ptr = ctx->histTail ; ptr != NULL ; ptr = ptr->prev) size += snapshot_put(NULL, ptr->cmd);
+    header.size = size;
+
+    char *image = wsh_malloc(ctx, MEM_IO, size);
+    if(image == NULL) return -1;
+
+    char *pos = image + sizeof(header);
+    memcpy(image, &header, sizeof(header));
+    pos += snapshot_put(pos, cwd);
+    for(LocalNode *ptr = ctx->localHead ; ptr != NULL ; ptr = ptr->next) {
+        pos += snapshot_put(pos, ptr->varname);
+        pos += snapshot_put(pos, ptr->varvalue);
+    }
+    for(int i = 0 ; i < ctx->env_len ; i++) pos += snapshot_put(pos, ctx->env[i]);
+    for(HistNode *ptr = ctx->histTail ; ptr != NULL ; ptr = ptr->prev) pos += snapshot_put(pos, ptr->cmd);
+
+    char tmp_name[PATH_MAX];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", file_name);
+
+    int rc = -1;
+    int fd = openat(ctx->cwd_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd >= 0) {
+        struct iovec iov = {image, size};
+        rc = writeAll(fd, &iov, 1);
+        if(close(fd) != 0) rc = -1;
+
+        if(rc == 0) rc = renameat(ctx->cwd_fd, tmp_name, ctx->cwd_fd, file_name);
+        if(rc != 0) unlinkat(ctx->cwd_fd, tmp_name, 0);
+    }
+
+    wsh_free(ctx, image);
+    return rc == 0 ? 0 : -1;
+}
+
+
+/**
+ * Loads a snapshot written by snapshot_save into the session
+ * The file is mapped and checked as a whole before anything is loaded, so a truncated or foreign
+ * file leaves the session untouched
+ * Locals and environment entries are set on top of the current ones and the history entries are
+ * added as the newest ones, a cwd that no longer exists keeps the current one
+ */
+int wsh_snapshot_load(wsh_ctx *ctx, const char *file_name) {
+    int fd = openat(ctx->cwd_fd, file_name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED) return -1;
+
+    const char *end = image + st.st_size;
+    SnapshotHeader header;
+    memcpy(&header, image, sizeof(header));
+
+    bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+                 header.version == SNAPSHOT_VERSION && header.size == (uint64_t) st.st_size &&
+                 header.history_capacity <= INT_MAX;
+
+    uint64_t nstrings = 1 + 2 * (uint64_t) header.nlocals + header.nenv + header.nhist;
+    const char *pos = image + sizeof(header);
+    for(uint64_t i = 0 ; valid && i < nstrings ; i++) {
+        if(snapshot_next(&pos, end) == NULL) valid = false;
+    }
+
+    if(!valid || pos != end) {
+        munmap(image, st.st_size);
+        return -1;
+    }
+
+    int rc = 0;
+    pos = image + sizeof(header);
+
+    const char *cwd = snapshot_next(&pos, end);
+    int new_cwd_fd = open(cwd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(new_cwd_fd >= 0) {
+        close(ctx->cwd_fd);
+        ctx->cwd_fd = new_cwd_fd;
+    }
+
+    for(uint32_t i = 0 ; i < header.nlocals ; i++) {
+        const char *varname = snapshot_next(&pos, end);
+        const char *varvalue = snapshot_next(&pos, end);
+        if(setLocal(ctx, varname, varvalue) == -1) rc = -1;
+    }
+
+    for(uint32_t i = 0 ; i < header.nenv ; i++) {
+        if(setEnv(ctx, snapshot_next(&pos, end)) == -1) rc = -1;
+    }
+
+    // room for every entry first, the capacity of the snapshot then drops the oldest ones
+    updateHistoryCapacity(ctx, ctx->curr_history_size + header.nhist);
+    for(uint32_t i = 0 ; i < header.nhist ; i++) addHistoryEntry(ctx, snapshot_next(&pos, end));
+    updateHistoryCapacity(ctx, header.history_capacity);
+
+    munmap(image, st.st_size);
+    return rc;
+}
+
+
+/**
+ * Built-In snapshot
+ * 1) snapshot save file - writes the state of the session to file
+ * 2) snapshot load file - loads a snapshot into the session, like wsh --restore file
+ */
+static int snapshot(wsh_ctx *ctx) {
+    if(count_cmd_args(ctx) != 2) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    int rc = -1;
+    if(strcmp(ctx->cmd_args[1], "save") == 0) rc = snapshot_save(ctx, ctx->cmd_args[2]);
+    else if(strcmp(ctx->cmd_args[1], "load") == 0) rc = wsh_snapshot_load(ctx, ctx->cmd_args[2]);
+
+    if(rc == -1) ctx->is_err = true;
+
+    return rc;
+}
+
+
+static bool cpuInMask(const unsigned long *mask, int cpu) {
+    return (mask[cpu / (8 * sizeof(unsigned long))] >> (cpu % (8 * sizeof(unsigned long)))) & 1UL;
+}
+
+
+/**
+ * Parses a cpu list like 0-3,8,10-11 into mask
+ */
+static int parse_cpulist(const char *cpulist, unsigned long *mask) {
+    memset(mask, 0, CPU_MASK_WORDS * sizeof(unsigned long));
+
+    const char *p = cpulist;
+    bool any = false;
+    while(*p != '\0') {
+        char *end;
+        if(!isdigit(*p)) return -1;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if(*end == '-') {
+            if(!isdigit(end[1])) return -1;
+            last = strtol(end + 1, &end, 10);
+        }
+        if(last < first || last >= MAXCPUS) return -1;
+
+        for(long cpu = first ; cpu <= last ; cpu++) {
+            mask[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+        }
+        any = true;
+
+        if(*end == ',') end++;
+        else if(*end != '\0') return -1;
+        p = end;
+    }
+
+    return any ? 0 : -1;
+}
+
+
+/**
+ * Next cpu of cpu_mask after the last one handed out, used to spread parallel jobs over the set
+ */
+static int nextCpu(wsh_ctx *ctx) {
+    for(int i = 1 ; i <= MAXCPUS ; i++) {
+        int cpu = (ctx->cpu_rr + i) % MAXCPUS;
+        if(cpuInMask(ctx->cpu_mask, cpu)) {
+            ctx->cpu_rr = cpu;
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * Built-In forall [-P N] [-n K] cmd args {} <items
+ * Runs cmd over every line of items, packing up to K items into one argv in place of {}
+ * (or at the end without a {}) and keeping up to N children running at once
+ * The command is looked up once, the size of every argv stays below ARG_MAX and
+ * $? is 123 if any of the children failed, 124 if a timeout stopped the run
+ */
+static int forall(wsh_ctx *ctx) {
+    long max_procs = 1;
+    long max_items = 1;
+
+    int ci = 1;
+    while(ctx->cmd_args[ci] != NULL && ctx->cmd_args[ci][0] == '-') {
+        long *opt = NULL;
+        if(strcmp(ctx->cmd_args[ci], "-P") == 0) opt = &max_procs;
+        else if(strcmp(ctx->cmd_args[ci], "-n") == 0) opt = &max_items;
+
+        char *end = NULL;
+        if(opt != NULL && ctx->cmd_args[ci + 1] != NULL) *opt = strtol(ctx->cmd_args[ci + 1], &end, 10);
+        if(opt == NULL || end == NULL || end == ctx->cmd_args[ci + 1] || *end != '\0' || *opt <= 0) {
+            ctx->is_err = true;
+            return -1;
+        }
+        ci += 2;
+    }
+
+    char cmd_path[4096];
+    if(ctx->cmd_args[ci] == NULL || resolve_cmd(ctx, ctx->cmd_args[ci], cmd_path, sizeof(cmd_path)) == -1) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    // the template is everything after the options, the items go where {} is
+    int ntemplate = 0;
+    int placeholder = -1;
+    long budget = sysconf(_SC_ARG_MAX) - 4096;
+    for(int i = 0 ; i < ctx->env_len ; i++) {
+        budget -= strlen(ctx->env[i]) + 1 + sizeof(char*);
+    }
+    for(int i = ci ; ctx->cmd_args[i] != NULL ; i++) {
+        if(placeholder == -1 && strcmp(ctx->cmd_args[i], "{}") == 0) placeholder = ntemplate;
+        else budget -= strlen(ctx->cmd_args[i]) + 1 + sizeof(char*);
+        ntemplate++;
+    }
+    if(placeholder == -1) placeholder = ntemplate;
+
+    // an item takes at least a byte, its NUL and its argv slot, more than that can never be packed
+    if(max_items > budget / (long) (2 + sizeof(char*)) || max_procs > FORALL_MAX_PROCS) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    int items_fd = (ctx->redirect_in && ctx->redirect_fd == STDIN_FILENO) ? ctx->redirect_open_fd : ctx->stdin_fd;
+    LineReader reader;
+    reader_init(ctx, &reader, items_fd);
+
+    // items of the batch being built are copied here, the argv points into it once it's complete
+    char *items = NULL;
+    size_t items_len = 0;
+    size_t items_cap = 0;
+    char **argv = (char**) wsh_malloc(ctx, MEM_IO, (ntemplate + max_items + 1) * sizeof(char*));
+
+    pid_t *pids = (pid_t*) wsh_calloc(ctx, MEM_IO, max_procs, sizeof(pid_t));
+    struct pollfd *fds = (struct pollfd*) wsh_calloc(ctx, MEM_IO, max_procs, sizeof(struct pollfd));
+
+    char *item = NULL;
+    size_t item_len = 0;
+    bool input_done = false;
+    long running = 0;
+    unsigned long failed = 0;
+
+    if(argv == NULL || pids == NULL || fds == NULL) input_done = true;
+
+    // a timeout covers the whole run, the jobs still running then get SIGTERM and later SIGKILL
+    long deadline = ctx->timeout_ms > 0 ? monotonicMs() + ctx->timeout_ms : 0;
+    bool timed_out = false;
+
+    wsh_out_flush(ctx);
+
+    while(true) {
+        if(deadline > 0 && monotonicMs() >= deadline) {
+            for(long i = 0 ; i < running ; i++) {
+                syscall(SYS_pidfd_send_signal, fds[i].fd, timed_out ? SIGKILL : SIGTERM, NULL, 0);
+            }
+
+            // after SIGKILL only the exits are left to wait for
+            deadline = timed_out ? 0 : deadline + TIMEOUT_KILL_MS;
+            timed_out = true;
+            input_done = true;
+        }
+
+        // start batches while a slot is free and there are items left
+        while(running < max_procs && !input_done) {
+            long nitems = 0;
+            size_t used = 0;
+            items_len = 0;
+
+            while(nitems < max_items) {
+                if(item == NULL) {
+                    item = reader_next_line(&reader, &item_len);
+                    if(item == NULL) {
+                        input_done = true;
+                        break;
+                    }
+                    if(item_len == 0) {
+                        item = NULL;
+                        continue;
+                    }
+                }
+
+                size_t cost = item_len + 1 + sizeof(char*);
+                if((long) (used + cost) > budget) {
+                    // an item which doesn't fit in an argv on its own can never run
+                    if(nitems == 0) {
+                        failed++;
+                        item = NULL;
+                        continue;
+                    }
+                    break;
+                }
+
+                if(items_len + item_len + 1 > items_cap) {
+                    size_t new_cap = items_cap == 0 ? READ_CHUNK : items_cap;
+                    while(new_cap < items_len + item_len + 1) new_cap *= 2;
+
+                    char *new_items = wsh_realloc(ctx, MEM_IO, items, new_cap);
+                    if(new_items == NULL) {
+                        input_done = true;
+                        break;
+                    }
+                    items = new_items;
+                    items_cap = new_cap;
+                }
+                memcpy(items + items_len, item, item_len + 1);
+                items_len += item_len + 1;
+                used += cost;
+                nitems++;
+                item = NULL;
+            }
+
+            if(nitems == 0) break;
+
+            int ai = 0;
+            for(int i = 0 ; i < placeholder ; i++) argv[ai++] = ctx->cmd_args[ci + i];
+            for(size_t off = 0 ; off < items_len ; off += strlen(items + off) + 1) argv[ai++] = items + off;
+            for(int i = placeholder + 1 ; i < ntemplate ; i++) argv[ai++] = ctx->cmd_args[ci + i];
+            argv[ai] = NULL;
+
+            ctx->job_cpu = ctx->cpu_mask_set ? nextCpu(ctx) : -1;
+
+            pid_t pid = fork();
+            if(pid == 0) {
+                // the items are read by the shell, the children get an empty stdin
+                child_setup(ctx);
+                int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if(null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0) _exit(-1);
+                close(null_fd);
+                execv(cmd_path, argv);
+                _exit(-1);
+            }
+
+            ctx->job_cpu = -1;
+
+            if(pid < 0) {
+                failed++;
+                continue;
+            }
+            ctx->stats.children++;
+
+            int pidfd = syscall(SYS_pidfd_open, pid, 0);
+            if(pidfd < 0) {
+                // without a pidfd the batch is waited for right away
+                long left = deadline > 0 ? deadline - monotonicMs() : 0;
+                if(wait_cmd(ctx, pid, deadline > 0 ? (left > 0 ? left : 1) : 0) != 0) failed++;
+                if(deadline > 0 && monotonicMs() >= deadline) {
+                    timed_out = true;
+                    input_done = true;
+                }
+                continue;
+            }
+
+            pids[running] = pid;
+            fds[running].fd = pidfd;
+            fds[running].events = POLLIN;
+            running++;
+        }
+
+        if(running == 0) break;
+
+        int wait_ms = -1;
+        if(deadline > 0) {
+            long left = deadline - monotonicMs();
+            wait_ms = left > 0 ? left : 0;
+        }
+
+        // only our own children are waited for, other sessions of the process may have some too
+        int ready = poll(fds, running, wait_ms);
+        if(ready < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+
+        // the deadline is handled at the top of the loop
+        if(ready == 0) continue;
+
+        for(long i = running - 1 ; i >= 0 ; i--) {
+            if(!(fds[i].revents & POLLIN)) continue;
+
+            if(wait_cmd(ctx, pids[i], 0) != 0) failed++;
+            close(fds[i].fd);
+
+            running--;
+            pids[i] = pids[running];
+            fds[i] = fds[running];
+        }
+    }
+
+    // something went wrong above, the remaining children are still waited for
+    for(long i = 0 ; i < running ; i++) {
+        if(wait_cmd(ctx, pids[i], 0) != 0) failed++;
+        close(fds[i].fd);
+    }
+
+    wsh_free(ctx, items);
+    wsh_free(ctx, argv);
+    wsh_free(ctx, pids);
+    wsh_free(ctx, fds);
+    reader_free(&reader);
+
+    if(timed_out) {
+        ctx->stats.timeouts++;
+        ctx->last_status = TIMEOUT_STATUS;
+        ctx->is_err = true;
+        return -1;
+    }
+
+    if(failed > 0) {
+        ctx->last_status = 123;
+        ctx->is_err = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Strips the prefixes that only change how the command gets launched from cmd_args
+ * timeout <ms> cmd - the command is terminated if it runs longer than ms milliseconds, for forall
+ * the deadline covers all of its children and exec / on-change can't be timed out
+ * affinity <cpulist> cmd - the command only runs on the given cpus, WSH_CPUSET is the default
+ * nice <n> cmd / nice -n <n> cmd - the command runs with its niceness raised by n
+ */
+static int parse_prefixes(wsh_ctx *ctx) {
+    ctx->timeout_ms = 0;
+    ctx->cpu_mask_set = false;
+    ctx->nice_inc = 0;
+
+    while(ctx->cmd_args[0] != NULL) {
+        int shift = 0;
+
+        if(strcmp(ctx->cmd_args[0], "timeout") == 0) {
+            if(ctx->cmd_args[1] == NULL || !isdigit(ctx->cmd_args[1][0])) return -1;
+
+            char *end;
+            long ms = strtol(ctx->cmd_args[1], &end, 10);
+            if(*end != '\0' || ms <= 0) return -1;
+
+            ctx->timeout_ms = ms;
+            shift = 2;
+        }
+        else if(strcmp(ctx->cmd_args[0], "affinity") == 0) {
+            if(ctx->cmd_args[1] == NULL || parse_cpulist(ctx->cmd_args[1], ctx->cpu_mask) == -1) return -1;
+
+            ctx->cpu_mask_set = true;
+            shift = 2;
+        }
+        else if(strcmp(ctx->cmd_args[0], "nice") == 0) {
+            // nice n cmd and nice -n n cmd, any other form is left to the nice executable
+            int inc_arg = 1;
+            if(ctx->cmd_args[1] != NULL && strcmp(ctx->cmd_args[1], "-n") == 0) inc_arg = 2;
+            else if(ctx->cmd_args[1] == NULL || !isdigit(ctx->cmd_args[1][0])) break;
+
+            if(ctx->cmd_args[inc_arg] == NULL) break;
+
+            char *end;
+            long inc = strtol(ctx->cmd_args[inc_arg], &end, 10);
+            if(end == ctx->cmd_args[inc_arg] || *end != '\0') break;
+            if(inc < -40 || inc > 40) return -1;
+
+            ctx->nice_inc = inc;
+            shift = inc_arg + 1;
+        }
+        else {
+            break;
+        }
+
+        int i = 0;
+        do {
+            ctx->cmd_args[i] = ctx->cmd_args[i + shift];
+            i++;
+        } while(ctx->cmd_args[i - 1] != NULL);
+    }
+
+    // a prefix without a command to run
+    if(ctx->cmd_args[0] == NULL) return -1;
+
+    // nothing is left to enforce a timeout once exec replaced the shell and on-change runs until stopped
+    if(ctx->timeout_ms > 0 && (strcmp(ctx->cmd_args[0], "exec") == 0 || strcmp(ctx->cmd_args[0], "on-change") == 0)) return -1;
+
+    // the session default keeps the children off the cpus not listed in it
+    if(!ctx->cpu_mask_set && ctx->default_cpu_mask_set) {
+        memcpy(ctx->cpu_mask, ctx->default_cpu_mask, sizeof(ctx->cpu_mask));
+        ctx->cpu_mask_set = true;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Finds the executable for cmd and stores its path in cmd_path
+ */
+static int resolve_cmd(wsh_ctx *ctx, const char *cmd, char *cmd_path, size_t cmd_path_sz) {
+    cmd_path[0] = '\0';
+
+    // accessing the arg0 passed by user directly may cause issues if a directory with name same as
+    // NON-built command exists
+    // Hence if a '/' exists in the user input command just execute it
+
+    if(strchr(cmd, '/') != NULL) {
+        snprintf(cmd_path, cmd_path_sz, "%s", cmd);
+    } else {
+        char *path_original = getEnv(ctx, "PATH");
+        char *path = wsh_strdup(ctx, MEM_PARSE, path_original != NULL ? path_original : "");
+        char *saveptr = NULL;
+
+        char *token = strtok_r(path, ":", &saveptr);
+        
+        while(token != NULL) {
+            snprintf(cmd_path, cmd_path_sz, "%s/%s", token, cmd);
+            if(faccessat(ctx->cwd_fd, cmd_path, X_OK, 0) == 0) break;
+
+            cmd_path[0] = '\0';
+            token = strtok_r(NULL, ":", &saveptr);
+        }
+
+        wsh_free(ctx, path);
+    }
+    
+    return strlen(cmd_path) == 0 ? -1 : 0;
+}
+
+
+/**
+ * Runs in the child between fork and execv, a failure ends the child with _exit
+ * The child starts in the working directory of the session, gets its redirections, its limits
+ * and its cpus / niceness
+ */
+static void child_setup(wsh_ctx *ctx) {
+    // relative paths are resolved against the working directory of the session
+    if(fchdir(ctx->cwd_fd) != 0 || apply_redirection(ctx) != 0) _exit(-1);
+
+    for(int i = 0 ; i < NLIMITS ; i++) {
+        if(!ctx->limit_set[i]) continue;
+
+        struct rlimit rl = {ctx->limits[i], ctx->limits[i]};
+        if(setrlimit(limit_specs[i].resource, &rl) != 0) _exit(-1);
+    }
+
+    // parallel jobs get a single cpu of the set each
+    if(ctx->job_cpu >= 0 || ctx->cpu_mask_set) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(int cpu = 0 ; cpu < MAXCPUS && cpu < CPU_SETSIZE ; cpu++) {
+            if(ctx->job_cpu >= 0 ? cpu == ctx->job_cpu : cpuInMask(ctx->cpu_mask, cpu)) CPU_SET(cpu, &set);
+        }
+        if(sched_setaffinity(0, sizeof(set), &set) != 0) _exit(-1);
+    }
+
+    if(ctx->nice_inc != 0) {
+        errno = 0;
+        if(nice(ctx->nice_inc) == -1 && errno != 0) _exit(-1);
+    }
+
+    environ = ctx->env;
+}
+
+
+/**
+ * Fallback of wait_cmd when no pidfd or timerfd can be had, the child is polled every few ms
+ * It is left unreaped for wait_cmd, so its pid can't be reused while we may still signal it
+ * Returns whether the child had to be stopped
+ */
+static bool wait_deadline(pid_t pid, long timeout_ms) {
+    long deadline = monotonicMs() + timeout_ms;
+    bool timed_out = false;
+
+    while(true) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if(waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 && errno != EINTR) break;
+        if(info.si_pid != 0) break;
+
+        long left = deadline - monotonicMs();
+        if(left <= 0) {
+            kill(pid, timed_out ? SIGKILL : SIGTERM);
+
+            // after SIGKILL only the exit is left to wait for
+            deadline = timed_out ? LONG_MAX : deadline + TIMEOUT_KILL_MS;
+            timed_out = true;
+            continue;
+        }
+
+        poll(NULL, 0, left < 10 ? left : 10);
+    }
+
+    return timed_out;
+}
+
+
+static long rusageCpuUs(const struct rusage *ru) {
+    return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000L + ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+}
+
+
+/**
+ * Waits for the child and returns its status the way $? reports it
+ * With a timeout the child is watched through a pidfd and a timerfd, it gets SIGTERM when the
+ * timeout fires and SIGKILL if it is still running TIMEOUT_KILL_MS later
+ * Kernels without pidfds get the same deadline from wait_deadline
+ */
+static int wait_cmd(wsh_ctx *ctx, pid_t pid, long timeout_ms) {
+    bool timed_out = false;
+
+    if(timeout_ms > 0) {
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+        if(pidfd >= 0 && timer_fd >= 0) {
+            struct itimerspec its = {{0, 0}, {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L}};
+            timerfd_settime(timer_fd, 0, &its, NULL);
+
+            struct pollfd fds[2] = {{pidfd, POLLIN, 0}, {timer_fd, POLLIN, 0}};
+            while(true) {
+                if(poll(fds, 2, -1) < 0) {
+                    if(errno == EINTR) continue;
+                    break;
+                }
+
+                // the child exited
+                if(fds[0].revents & POLLIN) break;
+
+                if(fds[1].revents & POLLIN) {
+                    uint64_t expirations;
+                    if(read(timer_fd, &expirations, sizeof(expirations)) < 0) break;
+
+                    if(!timed_out) {
+                        timed_out = true;
+                        syscall(SYS_pidfd_send_signal, pidfd, SIGTERM, NULL, 0);
+
+                        struct itimerspec grace = {{0, 0}, {TIMEOUT_KILL_MS / 1000, (TIMEOUT_KILL_MS % 1000) * 1000000L}};
+                        timerfd_settime(timer_fd, 0, &grace, NULL);
+                    } else {
+                        syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0);
+                    }
+                }
+            }
+        }
+        else {
+            timed_out = wait_deadline(pid, timeout_ms);
+        }
+
+        if(pidfd >= 0) close(pidfd);
+        if(timer_fd >= 0) close(timer_fd);
+    }
+
+    int status_ptr;
+    struct rusage ru;
+    while(wait4(pid, &status_ptr, 0, &ru) < 0) {
+        if(errno != EINTR) return -1;
+    }
+
+    ctx->child_cpu_us += rusageCpuUs(&ru);
+
+    if(timed_out) {
+        ctx->stats.timeouts++;
+        return TIMEOUT_STATUS;
+    }
+
+    // wifexited returns true if the child process exited normally
+    if(WIFEXITED(status_ptr)) {
+        // get exit status of the child process
+        return WEXITSTATUS(status_ptr);
+    }
+
+    return 128 + WTERMSIG(status_ptr);
+}
+
+
+/**
+ * Replaces the shell with argv, the same setup as a child gets is applied to the shell itself
+ * Only returns if the command can't be found, any later failure exits with -1
+ * An embedder calling this loses its process, which is what exec means
+ */
+static int exec_replace(wsh_ctx *ctx, char **argv) {
+    char cmd_path[4096];
+
+    if(resolve_cmd(ctx, argv[0], cmd_path, sizeof(cmd_path)) == -1) {
+        ctx->last_status = 127;
+        ctx->is_err = true;
+        return -1;
+    }
+
+    wsh_out_flush(ctx);
+    fflush(NULL);
+    child_setup(ctx);
+    execv(cmd_path, argv);
+
+    _exit(-1);
+}
+
+
+/**
+ * Built-In exec cmd, runs cmd in place of the shell
+ */
+static int exec(wsh_ctx *ctx) {
+    if(ctx->cmd_args[1] == NULL) return 0;
+
+    return exec_replace(ctx, ctx->cmd_args + 1);
+}
+
+
+/**
+ * Groups the tokens of a <(cmd) / >(cmd) starting at token, the ones up to the token ending with ')'
+ * are joined back into the inner command
+ * Returns the placeholder the argument is replaced by, NULL if the substitution isn't closed
+ */
+static char * parse_procsub(wsh_ctx *ctx, char *token, char **saveptr) {
+    if(ctx->nprocsubs == MAXPROCSUBS) return NULL;
+
+    ProcSub *sub = &ctx->procsubs[ctx->nprocsubs];
+    char *start = token + 2;
+    char *end = token + strlen(token);
+
+    while(end == start || end[-1] != ')') {
+        char *next = strtok_r(NULL, " ", saveptr);
+        if(next == NULL) return NULL;
+
+        // strtok_r cut the line after the previous token
+        for(char *p = end ; p < next ; p++) *p = ' ';
+        end = next + strlen(next);
+    }
+
+    end[-1] = '\0';
+    if(end - 1 == start) return NULL;
+
+    sub->cmd = start;
+    sub->write = token[0] == '>';
+    sub->pid = -1;
+    sub->fd = -1;
+    sub->path[0] = '\0';
+    ctx->nprocsubs++;
+
+    return sub->path;
+}
+
+
+/**
+ * Launches the inner commands of the process substitutions, each one on its own pipe
+ * The ends kept by the shell are close-on-exec so only the command itself inherits them
+ */
+static int start_procsubs(wsh_ctx *ctx) {
+    ctx->procsub_deadline = ctx->timeout_ms > 0 ? monotonicMs() + ctx->timeout_ms : 0;
+
+    for(int i = 0 ; i < ctx->nprocsubs ; i++) {
+        ProcSub *sub = &ctx->procsubs[i];
+        char *argv[MAXARGS];
+        char *saveptr = NULL;
+        int argc = 0;
+
+        for(char *token = strtok_r(sub->cmd, " ", &saveptr) ; token != NULL ; token = strtok_r(NULL, " ", &saveptr)) {
+            if(argc == MAXARGS - 1) return -1;
+            argv[argc++] = token[0] == '$' ? getVarValue(ctx, token + 1) : token;
+        }
+        argv[argc] = NULL;
+
+        char cmd_path[4096];
+        if(argc == 0 || resolve_cmd(ctx, argv[0], cmd_path, sizeof(cmd_path)) == -1) {
+            ctx->last_status = 127;
+            return -1;
+        }
+
+        int pipe_fds[2];
+        if(pipe2(pipe_fds, O_CLOEXEC) != 0) return -1;
+
+        // <(cmd) writes into the pipe and the command reads the other end, >(cmd) the other way around
+        int inner_fd = sub->write ? pipe_fds[0] : pipe_fds[1];
+        sub->fd = sub->write ? pipe_fds[1] : pipe_fds[0];
+
+        wsh_out_flush(ctx);
+
+        pid_t pid = fork();
+        if(pid < 0) {
+            close(inner_fd);
+            return -1;
+        }
+        else if(pid == 0) {
+            // the redirection and the substitutions belong to the outer command
+            clear_redirection_vars(ctx);
+            ctx->nprocsubs = 0;
+            child_setup(ctx);
+
+            if(dup2(inner_fd, sub->write ? STDIN_FILENO : STDOUT_FILENO) < 0) _exit(-1);
+            execv(cmd_path, argv);
+            _exit(-1);
+        }
+
+        close(inner_fd);
+        sub->pid = pid;
+        snprintf(sub->path, sizeof(sub->path), "/dev/fd/%d", sub->fd);
+        ctx->stats.children++;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Closes the ends of the pipes kept by the shell and waits for the inner commands
+ * Every pipe is closed first so a >(cmd) sees the end of its input and a <(cmd) nobody reads stops
+ * The timeout of the command covers them too, they are stopped like it once it ran out
+ */
+static void reap_procsubs(wsh_ctx *ctx) {
+    for(int i = 0 ; i < ctx->nprocsubs ; i++) {
+        if(ctx->procsubs[i].fd != -1) close(ctx->procsubs[i].fd);
+        ctx->procsubs[i].fd = -1;
+    }
+
+    for(int i = 0 ; i < ctx->nprocsubs ; i++) {
+        if(ctx->procsubs[i].pid <= 0) continue;
+
+        if(ctx->procsub_deadline > 0) {
+            long left = ctx->procsub_deadline - monotonicMs();
+            wait_deadline(ctx->procsubs[i].pid, left > 0 ? left : 1);
+        }
+
+        int status;
+        struct rusage ru;
+        pid_t reaped;
+        while((reaped = wait4(ctx->procsubs[i].pid, &status, 0, &ru)) < 0 && errno == EINTR);
+
+        if(reaped > 0) ctx->child_cpu_us += rusageCpuUs(&ru);
+        ctx->procsubs[i].pid = -1;
+    }
+
+    ctx->nprocsubs = 0;
+    ctx->procsub_deadline = 0;
+}
+
+
+static int run_cmd(wsh_ctx *ctx) {
+    char cmd_path[4096];
+
+    if(resolve_cmd(ctx, ctx->cmd_args[0], cmd_path, sizeof(cmd_path)) == -1) {
+        ctx->last_status = 127;
+        ctx->is_err = true;
+        return -1;
+    }
+
+    // the child must not inherit output the built-ins haven't written yet
+    wsh_out_flush(ctx);
+
+    pid_t pid = fork();
+    
+    if(pid < 0) {
+        // fork itself failed
+        ctx->last_status = 1;
+        ctx->is_err = true;
+        return -1;
+    }
+    else if(pid == 0) {
+        // child process where we execute the command
+        child_setup(ctx);
+        execv(cmd_path, ctx->cmd_args);
+        
+        // if execv returned it means some error
+        // this error will be handled in the parent exit_status handler
+        // _exit so nothing buffered by the parent gets written a second time
+        _exit(-1);
+    }
+
+    ctx->stats.children++;
+
+    ctx->last_status = wait_cmd(ctx, pid, ctx->timeout_ms);
+    if(ctx->last_status != 0) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Adds a tag and a value to a cache key, both NUL terminated so no two keys run into each other
+ */
+static int cache_key_add(wsh_ctx *ctx, char **key, size_t *key_len, size_t *key_cap, const char *tag, const char *value) {
+    if(appendBytes(ctx, key, key_len, key_cap, tag, strlen(tag) + 1) == -1) return -1;
+
+    return appendBytes(ctx, key, key_len, key_cap, value, strlen(value) + 1);
+}
+
+
+/**
+ * Adds a file the result depends on to a cache key
+ * Normally its inode, size and mtime stand for it, with strict its content is hashed instead
+ */
+static int cache_key_file(wsh_ctx *ctx, char **key, size_t *key_len, size_t *key_cap, const char *file_name, bool strict) {
+    char desc[128];
+    struct stat st;
+
+    int fd = openat(ctx->cwd_fd, file_name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        snprintf(desc, sizeof(desc), "missing");
+    }
+    else if(!strict) {
+        snprintf(desc, sizeof(desc), "%lu %lu %ld %ld.%09ld", (unsigned long) st.st_dev, (unsigned long) st.st_ino,
+                 (long) st.st_size, (long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    }
+    else {
+        unsigned long hash = 14695981039346656037UL;
+
+        if(st.st_size > 0) {
+            void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data == MAP_FAILED) {
+                close(fd);
+                return -1;
+            }
+            hash = hashBytes(hash, data, st.st_size);
+            munmap(data, st.st_size);
+        }
+
+        snprintf(desc, sizeof(desc), "%ld %016lx", (long) st.st_size, hash);
+    }
+
+    if(fd >= 0) close(fd);
+
+    if(cache_key_add(ctx, key, key_len, key_cap, "dep", file_name) == -1) return -1;
+
+    return cache_key_add(ctx, key, key_len, key_cap, strict ? "content" : "stat", desc);
+}
+
+
+/**
+ * Opens the cache directory, WSH_CACHE_DIR or wsh/ under $XDG_CACHE_HOME or ~/.cache, creating it if needed
+ * Entries are replayed as the output of real commands, so a directory anyone else can write to is never used
+ */
+static int cache_dir_open(wsh_ctx *ctx) {
+    char dir[PATH_MAX];
+    char *configured = getVarValue(ctx, "WSH_CACHE_DIR");
+    char *xdg = getVarValue(ctx, "XDG_CACHE_HOME");
+    char *home = getVarValue(ctx, "HOME");
+
+    if(strlen(configured) > 0) snprintf(dir, sizeof(dir), "%s", configured);
+    else if(strlen(xdg) > 0) snprintf(dir, sizeof(dir), "%s/wsh", xdg);
+    else if(strlen(home) > 0) {
+        // ~/.cache itself may not exist yet
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        if(mkdirat(ctx->cwd_fd, dir, 0700) != 0 && errno != EEXIST) return -1;
+        snprintf(dir, sizeof(dir), "%s/.cache/wsh", home);
+    }
+    else snprintf(dir, sizeof(dir), "/tmp/wsh-cache-%d", (int) getuid());
+
+    if(mkdirat(ctx->cwd_fd, dir, 0700) != 0 && errno != EEXIST) return -1;
+
+    int dir_fd = openat(ctx->cwd_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd < 0) return -1;
+
+    // someone else may have created the directory first and filled it with entries of their own
+    struct stat st;
+    if(fstat(dir_fd, &st) != 0 || st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        close(dir_fd);
+        return -1;
+    }
+
+    return dir_fd;
+}
+
+
+/**
+ * Writes a stored result to where the command would have written it, stdout first
+ */
+static void cache_replay(wsh_ctx *ctx, const char *out, size_t out_len, const char *err, size_t err_len) {
+    out_write(ctx, out, out_len);
+    wsh_out_flush(ctx);
+
+    int err_fd = ctx->stderr_fd;
+    if(ctx->redirect_err) err_fd = ctx->out;
+    else if(ctx->redirect_out && ctx->redirect_fd == STDERR_FILENO) err_fd = ctx->redirect_open_fd;
+
+    struct iovec iov = {(char*) err, err_len};
+    writeAll(err_fd, &iov, 1);
+}
+
+
+/**
+ * Replays the entry name if it holds the result for key
+ * A hit marks the entry as used for the eviction, returns -1 on a miss
+ */
+static int cache_lookup(wsh_ctx *ctx, int dir_fd, const char *name, const char *key, size_t key_len) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CacheEntryHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    char *entry = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(entry == MAP_FAILED) return -1;
+
+    CacheEntryHeader header;
+    memcpy(&header, entry, sizeof(header));
+
+    bool hit = memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 && header.version == CACHE_VERSION &&
+               header.key_len == key_len && header.out_len <= (uint64_t) st.st_size && header.err_len <= (uint64_t) st.st_size &&
+               sizeof(header) + key_len + header.out_len + header.err_len == (uint64_t) st.st_size &&
+               memcmp(entry + sizeof(header), key, key_len) == 0;
+
+    if(hit) {
+        const char *out = entry + sizeof(header) + key_len;
+        cache_replay(ctx, out, header.out_len, out + header.out_len, header.err_len);
+
+        ctx->last_status = header.status;
+        if(header.status != 0) ctx->is_err = true;
+
+        utimensat(dir_fd, name, NULL, 0);
+    }
+
+    munmap(entry, st.st_size);
+    return hit ? 0 : -1;
+}
+
+
+/**
+ * Writes the result of a command as the entry name, through a temporary file renamed into place
+ */
+static int cache_store(wsh_ctx *ctx, int dir_fd, const char *name, const char *key, size_t key_len, const char *out, size_t out_len, const char *err, size_t err_len) {
+    CacheEntryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.status = ctx->last_status;
+    header.key_len = key_len;
+    header.out_len = out_len;
+    header.err_len = err_len;
+
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d.tmp", name, (int) getpid());
+
+    int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0) return -1;
+
+    struct iovec iov[4] = {{&header, sizeof(header)}, {(char*) key, key_len}, {(char*) out, out_len}, {(char*) err, err_len}};
+    int rc = writeAll(fd, iov, 4);
+    if(close(fd) != 0) rc = -1;
+
+    if(rc == 0) rc = renameat(dir_fd, tmp_name, dir_fd, name);
+    if(rc != 0) unlinkat(dir_fd, tmp_name, 0);
+
+    return rc == 0 ? 0 : -1;
+}
+
+
+static int compareCacheFiles(const void *a, const void *b) {
+    const CacheFile *x = a;
+    const CacheFile *y = b;
+
+    if(x->used.tv_sec != y->used.tv_sec) return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    if(x->used.tv_nsec != y->used.tv_nsec) return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+
+    return 0;
+}
+
+
+/**
+ * Keeps the cache directory under max_bytes by removing the entries used the longest time ago
+ * A hit touches the mtime of its entry so the mtime is the last use
+ */
+static int cache_evict(wsh_ctx *ctx, int dir_fd, long max_bytes) {
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) return -1;
+
+    DIR *dir = fdopendir(fd);
+    if(dir == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    CacheFile *files = NULL;
+    size_t nfiles = 0;
+    size_t cap = 0;
+    long total = 0;
+    struct dirent *entry;
+
+    while((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if(len >= sizeof(files->name) || len < 6 || strcmp(entry->d_name + len - 6, ".entry") != 0) continue;
+
+        struct stat st;
+        if(fstatat(dir_fd, entry->d_name, &st, 0) != 0) continue;
+
+        if(nfiles == cap) {
+            size_t new_cap = cap == 0 ? 64 : cap * 2;
+            CacheFile *new_files = wsh_realloc(ctx, MEM_IO, files, new_cap * sizeof(CacheFile));
+            if(new_files == NULL) break;
+
+            files = new_files;
+            cap = new_cap;
+        }
+
+        files[nfiles].used = st.st_mtim;
+        files[nfiles].size = st.st_size;
+        memcpy(files[nfiles].name, entry->d_name, len + 1);
+        nfiles++;
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    if(total > max_bytes) {
+        qsort(files, nfiles, sizeof(CacheFile), compareCacheFiles);
+
+        for(size_t i = 0 ; i < nfiles && total > max_bytes ; i++) {
+            if(unlinkat(dir_fd, files[i].name, 0) == 0) total -= files[i].size;
+        }
+    }
+
+    wsh_free(ctx, files);
+    return 0;
+}
+
+
+/**
+ * Runs the command with its stdout and stderr captured in memfds, replays them and stores the result
+ * Timeouts, commands killed by a signal and commands that can't run aren't stored
+ */
+static int cache_run(wsh_ctx *ctx, int dir_fd, const char *name, const char *key, size_t key_len) {
+    int out_fd = memfd_create("wsh-cached-out", MFD_CLOEXEC);
+    int err_fd = memfd_create("wsh-cached-err", MFD_CLOEXEC);
+    if(out_fd < 0 || err_fd < 0) {
+        if(out_fd >= 0) close(out_fd);
+        if(err_fd >= 0) close(err_fd);
+        return run_cmd(ctx);
+    }
+
+    // the captured output is replayed through the redirection of cached itself
+    int saved_stdout_fd = ctx->stdout_fd;
+    int saved_stderr_fd = ctx->stderr_fd;
+    bool saved_redirect_out = ctx->redirect_out;
+    bool saved_redirect_err = ctx->redirect_err;
+    unsigned long timeouts = ctx->stats.timeouts;
+
+    ctx->stdout_fd = out_fd;
+    ctx->stderr_fd = err_fd;
+    ctx->redirect_out = false;
+    ctx->redirect_err = false;
+
+    run_cmd(ctx);
+
+    ctx->stdout_fd = saved_stdout_fd;
+    ctx->stderr_fd = saved_stderr_fd;
+    ctx->redirect_out = saved_redirect_out;
+    ctx->redirect_err = saved_redirect_err;
+
+    struct stat out_st, err_st;
+    char *out = NULL;
+    char *err = NULL;
+    int rc = -1;
+
+    if(fstat(out_fd, &out_st) == 0 && fstat(err_fd, &err_st) == 0) {
+        if(out_st.st_size > 0) out = mmap(NULL, out_st.st_size, PROT_READ, MAP_PRIVATE, out_fd, 0);
+        if(err_st.st_size > 0) err = mmap(NULL, err_st.st_size, PROT_READ, MAP_PRIVATE, err_fd, 0);
+
+        if(out != MAP_FAILED && err != MAP_FAILED) {
+            cache_replay(ctx, out, out_st.st_size, err, err_st.st_size);
+            rc = 0;
+
+            long max_bytes = strtol(getVarValue(ctx, "WSH_CACHE_SIZE"), NULL, 10);
+            if(max_bytes <= 0) max_bytes = CACHE_MAX_BYTES;
+
+            size_t entry_size = sizeof(CacheEntryHeader) + key_len + out_st.st_size + err_st.st_size;
+            if(ctx->last_status < TIMEOUT_STATUS && ctx->stats.timeouts == timeouts && entry_size <= (size_t) max_bytes &&
+               cache_store(ctx, dir_fd, name, key, key_len, out, out_st.st_size, err, err_st.st_size) == 0) {
+                cache_evict(ctx, dir_fd, max_bytes);
+            }
+        }
+
+        if(out != NULL && out != MAP_FAILED) munmap(out, out_st.st_size);
+        if(err != NULL && err != MAP_FAILED) munmap(err, err_st.st_size);
+    }
+
+    close(out_fd);
+    close(err_fd);
+
+    return rc;
+}
+
+
+/**
+ * Built-In cached [--dep file]... [--env VAR]... [--strict] [--] cmd args
+ * Replays the stdout, stderr and status of an earlier run of cmd instead of running it again
+ * The key is the argv, the resolved executable, the cwd, the listed environment variables, the
+ * stdin file or here-document and the --dep files, by inode / size / mtime or by content with --strict
+ */
+static int cached(wsh_ctx *ctx) {
+    char *deps[MAXARGS];
+    char *vars[MAXARGS];
+    int ndeps = 0;
+    int nvars = 0;
+    bool strict = false;
+    int arg = 1;
+
+    while(ctx->cmd_args[arg] != NULL && strncmp(ctx->cmd_args[arg], "--", 2) == 0) {
+        char *opt = ctx->cmd_args[arg];
+
+        if(strcmp(opt, "--") == 0) {
+            arg++;
+            break;
+        }
+        else if(strcmp(opt, "--strict") == 0) {
+            strict = true;
+            arg++;
+        }
+        else if(strcmp(opt, "--dep") == 0 && ctx->cmd_args[arg + 1] != NULL) {
+            deps[ndeps++] = ctx->cmd_args[arg + 1];
+            arg += 2;
+        }
+        else if(strcmp(opt, "--env") == 0 && ctx->cmd_args[arg + 1] != NULL) {
+            vars[nvars++] = ctx->cmd_args[arg + 1];
+            arg += 2;
+        }
+        else {
+            ctx->is_err = true;
+            return -1;
+        }
+    }
+
+    if(ctx->cmd_args[arg] == NULL) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    int i = 0;
+    do {
+        ctx->cmd_args[i] = ctx->cmd_args[i + arg];
+        i++;
+    } while(ctx->cmd_args[i - 1] != NULL);
+
+    // a command that can't be found is reported by run_cmd, it is never cached
+    char cmd_path[4096];
+    struct stat cmd_st;
+    if(resolve_cmd(ctx, ctx->cmd_args[0], cmd_path, sizeof(cmd_path)) == -1 || fstatat(ctx->cwd_fd, cmd_path, &cmd_st, 0) != 0) {
+        return run_cmd(ctx);
+    }
+
+    char cwd[PATH_MAX];
+    char fd_path[32];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", ctx->cwd_fd);
+    ssize_t cwd_len = readlink(fd_path, cwd, sizeof(cwd) - 1);
+    cwd[cwd_len < 0 ? 0 : cwd_len] = '\0';
+
+    char cmd_desc[128];
+    snprintf(cmd_desc, sizeof(cmd_desc), "%lu %ld %ld.%09ld", (unsigned long) cmd_st.st_ino, (long) cmd_st.st_size,
+             (long) cmd_st.st_mtim.tv_sec, cmd_st.st_mtim.tv_nsec);
+
+    char *key = NULL;
+    size_t key_len = 0;
+    size_t key_cap = 0;
+    int rc = 0;
+
+    if(cache_key_add(ctx, &key, &key_len, &key_cap, "cwd", cwd) == -1) rc = -1;
+    if(rc == 0 && cache_key_add(ctx, &key, &key_len, &key_cap, cmd_path, cmd_desc) == -1) rc = -1;
+    for(i = 0 ; rc == 0 && ctx->cmd_args[i] != NULL ; i++) {
+        if(cache_key_add(ctx, &key, &key_len, &key_cap, "arg", ctx->cmd_args[i]) == -1) rc = -1;
+    }
+    for(i = 0 ; rc == 0 && i < nvars ; i++) {
+        char *value = getEnv(ctx, vars[i]);
+        if(cache_key_add(ctx, &key, &key_len, &key_cap, vars[i], value != NULL ? value : "") == -1) rc = -1;
+    }
+    for(i = 0 ; rc == 0 && i < ndeps ; i++) {
+        if(cache_key_file(ctx, &key, &key_len, &key_cap, deps[i], strict) == -1) rc = -1;
+    }
+
+    // whatever the command reads on stdin is part of the key as well
+    if(rc == 0 && ctx->redirect_heredoc) {
+        if(cache_key_add(ctx, &key, &key_len, &key_cap, "stdin", "") == -1 ||
+           appendBytes(ctx, &key, &key_len, &key_cap, ctx->heredoc_body, ctx->heredoc_len) == -1) rc = -1;
+    }
+    else if(rc == 0 && ctx->redirect_in) {
+        if(cache_key_file(ctx, &key, &key_len, &key_cap, ctx->redirect_filename, strict) == -1) rc = -1;
+    }
+
+    int dir_fd = rc == 0 ? cache_dir_open(ctx) : -1;
+    if(dir_fd < 0) {
+        wsh_free(ctx, key);
+        return run_cmd(ctx);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016lx.entry", hashBytes(14695981039346656037UL, key, key_len));
+
+    if(cache_lookup(ctx, dir_fd, name, key, key_len) == -1) rc = cache_run(ctx, dir_fd, name, key, key_len);
+
+    close(dir_fd);
+    wsh_free(ctx, key);
+
+    return rc;
+}
+
+
+static long monotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+
+static long monotonicUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+
+/**
+ * Watches path, and with a recursive set every directory below it
+ */
+static int watch_add(wsh_ctx *ctx, WatchSet *ws, const char *path) {
+    uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    int wd = inotify_add_watch(ws->fd, path, mask);
+    if(wd < 0) return -1;
+
+    if(wd >= ws->cap) {
+        int new_cap = ws->cap == 0 ? 64 : ws->cap;
+        while(new_cap <= wd) new_cap *= 2;
+
+        char **new_paths = wsh_realloc(ctx, MEM_IO, ws->paths, new_cap * sizeof(char*));
+        if(new_paths == NULL) return -1;
+
+        memset(new_paths + ws->cap, 0, (new_cap - ws->cap) * sizeof(char*));
+        ws->paths = new_paths;
+        ws->cap = new_cap;
+    }
+
+    // the same directory reached twice keeps its watch
+    if(ws->paths[wd] == NULL) {
+        ws->paths[wd] = wsh_strdup(ctx, MEM_IO, path);
+        if(ws->paths[wd] == NULL) return -1;
+        ws->live++;
+    }
+
+    if(!ws->recursive) return 0;
+
+    DIR *dir = opendir(path);
+    if(dir == NULL) return 0;
+
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        struct stat st;
+        if(entry->d_type != DT_DIR && (entry->d_type != DT_UNKNOWN || fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode))) continue;
+
+        char sub_path[PATH_MAX];
+        snprintf(sub_path, sizeof(sub_path), "%s/%s", path, entry->d_name);
+        watch_add(ctx, ws, sub_path);
+    }
+    closedir(dir);
+
+    return 0;
+}
+
+
+/**
+ * Reads every pending event and returns how many there were
+ * New directories of a recursive set get their own watches and a watched file replaced by a
+ * rename, the way editors save, is watched again under its name
+ */
+static int watch_drain(wsh_ctx *ctx, WatchSet *ws) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int events = 0;
+
+    while(true) {
+        ssize_t n = read(ws->fd, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+
+        const struct inotify_event *ev;
+        for(char *p = buf ; p < buf + n ; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            char *path = (ev->wd >= 0 && ev->wd < ws->cap) ? ws->paths[ev->wd] : NULL;
+            if(path == NULL) continue;
+
+            // the path was removed or replaced, a new file under the same name is watched again
+            if(ev->mask & IN_IGNORED) {
+                ws->paths[ev->wd] = NULL;
+                ws->live--;
+                watch_add(ctx, ws, path);
+                wsh_free(ctx, path);
+                continue;
+            }
+
+            if(ws->recursive && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->len > 0) {
+                char sub_path[PATH_MAX];
+                snprintf(sub_path, sizeof(sub_path), "%s/%s", path, ev->name);
+                watch_add(ctx, ws, sub_path);
+            }
+
+            events++;
+        }
+    }
+
+    return events;
+}
+
+
+static void watch_free(wsh_ctx *ctx, WatchSet *ws) {
+    for(int i = 0 ; i < ws->cap ; i++) wsh_free(ctx, ws->paths[i]);
+    wsh_free(ctx, ws->paths);
+    ws->paths = NULL;
+    ws->cap = 0;
+
+    if(ws->fd >= 0) close(ws->fd);
+    ws->fd = -1;
+}
+
+
+/**
+ * Built-In on-change [-r] [-d ms] [-m ms] [-n count] path... -- cmd args
+ * Blocks on inotify until one of the paths changes and then runs cmd, for ever or count times
+ * -r - watches the directories recursively, including the ones created later
+ * -d ms - events closer together than ms are one change, ON_CHANGE_DEBOUNCE_MS by default
+ * -m ms - at least ms between the start of two runs, the changes meanwhile make one run
+ * The command is taken from the line as typed and goes through wsh_eval_line on every run, so its
+ * variables and redirection are evaluated again each time
+ * Fails once every watched path was removed
+ */
+static int on_change(wsh_ctx *ctx) {
+    long debounce_ms = ON_CHANGE_DEBOUNCE_MS;
+    long interval_ms = 0;
+    long count = 0;
+    bool recursive = false;
+    int arg = 1;
+
+    while(ctx->cmd_args[arg] != NULL && ctx->cmd_args[arg][0] == '-' && strcmp(ctx->cmd_args[arg], "--") != 0) {
+        char *opt = ctx->cmd_args[arg];
+
+        if(strcmp(opt, "-r") == 0) {
+            recursive = true;
+            arg++;
+            continue;
+        }
+
+        if(ctx->cmd_args[arg + 1] == NULL || (strcmp(opt, "-d") != 0 && strcmp(opt, "-m") != 0 && strcmp(opt, "-n") != 0)) {
+            ctx->is_err = true;
+            return -1;
+        }
+
+        char *end;
+        long value = strtol(ctx->cmd_args[arg + 1], &end, 10);
+        if(end == ctx->cmd_args[arg + 1] || *end != '\0' || value < 0) {
+            ctx->is_err = true;
+            return -1;
+        }
+
+        if(opt[1] == 'd') debounce_ms = value;
+        else if(opt[1] == 'm') interval_ms = value;
+        else count = value;
+        arg += 2;
+    }
+
+    int sep = arg;
+    while(ctx->cmd_args[sep] != NULL && strcmp(ctx->cmd_args[sep], "--") != 0) sep++;
+
+    char *cmd_start = strstr(ctx->curr_command, " -- ");
+    if(sep == arg || ctx->cmd_args[sep] == NULL || ctx->cmd_args[sep + 1] == NULL || cmd_start == NULL) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    char *cmd_line = wsh_strdup(ctx, MEM_PARSE, cmd_start + 4);
+    WatchSet ws = {inotify_init1(IN_NONBLOCK | IN_CLOEXEC), recursive, NULL, 0, 0};
+
+    int rc = cmd_line == NULL || ws.fd < 0 ? -1 : 0;
+    for(int i = arg ; rc == 0 && i < sep ; i++) {
+        // inotify has no *at call, relative paths go through the cwd fd of the session
+        char path[PATH_MAX];
+        if(ctx->cmd_args[i][0] == '/') snprintf(path, sizeof(path), "%s", ctx->cmd_args[i]);
+        else snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", ctx->cwd_fd, ctx->cmd_args[i]);
+
+        if(watch_add(ctx, &ws, path) == -1) rc = -1;
+    }
+
+    // the runs must come back to the loop
+    ctx->tail_candidate = false;
+
+    struct pollfd pfd = {ws.fd, POLLIN, 0};
+    long last_run = 0;
+    long runs = 0;
+
+    while(rc == 0 && !ctx->exited && (count == 0 || runs < count)) {
+        // everything watched is gone, nothing could ever trigger another run
+        if(ws.live == 0) {
+            rc = -1;
+            break;
+        }
+
+        if(poll(&pfd, 1, -1) < 0) {
+            if(errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if(watch_drain(ctx, &ws) == 0) continue;
+
+        // a burst of events, like a build writing many files, is a single change
+        while(poll(&pfd, 1, debounce_ms) > 0) watch_drain(ctx, &ws);
+
+        // held back by the rate limit, the changes meanwhile are folded into this run
+        long wait_ms = last_run + interval_ms - monotonicMs();
+        while(runs > 0 && wait_ms > 0) {
+            if(poll(&pfd, 1, wait_ms) > 0) watch_drain(ctx, &ws);
+            wait_ms = last_run + interval_ms - monotonicMs();
+        }
+
+        last_run = monotonicMs();
+        wsh_eval_line(ctx, cmd_line);
+        runs++;
+    }
+
+    if(rc == -1) ctx->is_err = true;
 
-    int cmdLength = getline(&cmd, &cmd_sz, stdin);
-    if(cmdLength == -1) return -1;
+    watch_free(ctx, &ws);
+    wsh_free(ctx, cmd_line);
 
-    return 0;
+    return rc;
 }
 
-void clear_redirection_vars(void) {
+
+static void clear_redirection_vars(wsh_ctx *ctx) {
 
     // redirection
-    redirect_filename = NULL;
-    redirect_fd = -1;
+    ctx->redirect_filename = NULL;
+    ctx->redirect_fd = -1;
 
-    redirect_append = false;
+    ctx->redirect_append = false;
 
-    redirect_in = false;
-    redirect_out = false;
-    redirect_err = false;
+    ctx->redirect_in = false;
+    ctx->redirect_out = false;
+    ctx->redirect_err = false;
 
-    orig_stdin = -1;
-    orig_stderr = -1;
-    orig_stdn = -1;
+    ctx->redirect_heredoc = false;
+    ctx->heredoc_string = false;
+    ctx->heredoc_expand = true;
+    ctx->heredoc_len = 0;
     
 }
 
 
-int set_redirection(void) {
-
-    if(redirect_out) {
-        int is_fd_valid = fcntl(redirect_fd, F_GETFD);
+/**
+ * Redirection for the built-ins
+ * The file is opened the same way a child would open it and if it targets stdout
+ * the built-in prints into it instead of the stdout of the session
+ */
+static int set_redirection(wsh_ctx *ctx) {
 
-        int output_fd = open(redirect_filename, O_WRONLY | O_CREAT | (redirect_append ? O_APPEND : O_TRUNC), 0644);
+    if(ctx->redirect_out) {
+        int output_fd = openat(ctx->cwd_fd, ctx->redirect_filename, O_WRONLY | O_CREAT | O_CLOEXEC | (ctx->redirect_append ? O_APPEND : O_TRUNC), 0644);
         if(output_fd < 0) {
-            is_err = true;
+            ctx->is_err = true;
             return -1;
         }
 
-        if(is_fd_valid == -1) {
-            // this fd points to nothing
-            orig_stdn = -1;
-            if(redirect_fd != output_fd) {
-                if(dup2(output_fd, redirect_fd) < 0) {
-                    is_err = true;
-                    return -1;
-                }
-            }
-        } else {
-            // guaranteed to exists since is_fd_valid is not -1
-            orig_stdn = dup(redirect_fd);
-
-            if(redirect_err) {
-                orig_stderr = dup(STDERR_FILENO);
-                if(dup2(output_fd, STDERR_FILENO) < 0 || orig_stderr < 0) {
-                    is_err = true;
-                    return -1;
-                }
-            }
-            
-            if(dup2(output_fd, redirect_fd) < 0) {
-                is_err = true;
-                return -1;
-            }
-        }
-
-        close(output_fd);
+        ctx->redirect_open_fd = output_fd;
+        if(ctx->redirect_fd == STDOUT_FILENO) ctx->out = output_fd;
     }
 
-    if(redirect_in) {
-        int input_fd = open(redirect_filename, O_RDONLY);
+    if(ctx->redirect_in) {
+        int input_fd = ctx->redirect_heredoc ? heredoc_open(ctx) : openat(ctx->cwd_fd, ctx->redirect_filename, O_RDONLY | O_CLOEXEC);
         if(input_fd < 0) {
-            is_err = true;
+            ctx->is_err = true;
             return -1;
         }
 
-        orig_stdn = dup(redirect_fd);
-        if(dup2(input_fd, redirect_fd) < 0 || orig_stdn < 0) {
-            is_err = true;
-            return -1;
-        }
-        close(input_fd);
+        ctx->redirect_open_fd = input_fd;
     }
     
     return 0;
@@ -654,119 +3188,272 @@ int set_redirection(void) {
 }
 
 
-int unset_redirection(void) {
-
-    if(!(redirect_in || redirect_out || redirect_err)) {
-        return -1;
-    }
-
-    if(orig_stdn != -1) {
-        if(dup2(orig_stdn, redirect_fd) < 0) {
-            is_err = true;
-            return -1;
-        }
-        close(orig_stdn);
-    } else {
-        close(redirect_fd);
-    }
+static int unset_redirection(wsh_ctx *ctx) {
 
-    if(orig_stderr != -1) {
-        if(dup2(orig_stderr, STDERR_FILENO) < 0) {
-            is_err = true;
-            return -1;
-        }
-        close(orig_stderr);
-    }
+    // the output of the built-in goes to the file it was redirected to
+    wsh_out_flush(ctx);
+    ctx->out = ctx->stdout_fd;
 
-    if(orig_stdin != -1) {
-        if(dup2(orig_stdin, STDIN_FILENO) < 0) {
-            is_err = true;
-            return -1;
-        }
-        close(orig_stdin);
+    if(ctx->redirect_open_fd == -1) {
+        return -1;
     }
 
-    clear_redirection_vars();
+    close(ctx->redirect_open_fd);
+    ctx->redirect_open_fd = -1;
 
     return 0;
 }
 
 
-int check_redirection(char *token) {
+static int check_redirection(wsh_ctx *ctx, char *token) {
+    char *saveptr = NULL;
 
     // strstr will check if redirection symbols are present in our token
-    if(strstr(token, "&>>") != NULL) {
+    // <<WORD starts a here-document ending at a line holding only WORD, <<<word is a one line here-string
+    if(strstr(token, "<<") != NULL) {
+        char *op = strstr(token, "<<");
+        if(op != token && !isdigit(token[0])) {
+            ctx->is_err = true;
+            return -1;
+        }
+        ctx->redirect_in = true;
+        ctx->redirect_heredoc = true;
+        ctx->redirect_fd = op == token ? STDIN_FILENO : atoi(token);
+
+        ctx->heredoc_string = op[2] == '<';
+        char *word = op + (ctx->heredoc_string ? 3 : 2);
+        size_t word_len = strlen(word);
+
+        // a quoted delimiter keeps the body as it is, without expanding variables
+        if(!ctx->heredoc_string && word_len >= 2 && (word[0] == '\'' || word[0] == '"') && word[word_len - 1] == word[0]) {
+            word[word_len - 1] = '\0';
+            word++;
+            ctx->heredoc_expand = false;
+        }
+
+        ctx->redirect_filename = strlen(word) > 0 ? word : NULL;
+    }
+    else if(strstr(token, "&>>") != NULL) {
         if(token[0] != '&') {
-            is_err = true;
+            ctx->is_err = true;
             return -1;
         }
-        redirect_out = true;
-        redirect_err = true;
-        redirect_append = true;
+        ctx->redirect_out = true;
+        ctx->redirect_err = true;
+        ctx->redirect_append = true;
 
-        redirect_fd = STDOUT_FILENO;
-        redirect_filename = strtok(token, "&>>");
+        ctx->redirect_fd = STDOUT_FILENO;
+        ctx->redirect_filename = strtok_r(token, "&>>", &saveptr);
     } 
     else if(strstr(token, "&>") != NULL) {
         if(token[0] != '&') {
-            is_err = true;
+            ctx->is_err = true;
             return -1;
         }
-        redirect_out = true;
-        redirect_err = true;
+        ctx->redirect_out = true;
+        ctx->redirect_err = true;
 
-        redirect_fd = STDOUT_FILENO;
-        redirect_filename = strtok(token, "&>");
+        ctx->redirect_fd = STDOUT_FILENO;
+        ctx->redirect_filename = strtok_r(token, "&>", &saveptr);
     }  
     else if(strstr(token, ">>") != NULL) {
-        redirect_out = true;
-        redirect_append = true;
+        ctx->redirect_out = true;
+        ctx->redirect_append = true;
         
         if(isdigit(token[0])) {
-            redirect_fd = atoi(strtok(token, ">>"));
-            redirect_filename = strtok(NULL, ">>");
+            ctx->redirect_fd = atoi(strtok_r(token, ">>", &saveptr));
+            ctx->redirect_filename = strtok_r(NULL, ">>", &saveptr);
         } else {
             if(token[0] != '>') {
-                is_err = true;
+                ctx->is_err = true;
                 return -1;
             }
-            redirect_fd = STDOUT_FILENO;
-            redirect_filename = strtok(token, ">>");
+            ctx->redirect_fd = STDOUT_FILENO;
+            ctx->redirect_filename = strtok_r(token, ">>", &saveptr);
         }
     }
     else if(strstr(token, ">") != NULL) {
-        redirect_out = true;
+        ctx->redirect_out = true;
 
         if(isdigit(token[0])) {
-            redirect_fd = atoi(strtok(token, ">"));
-            redirect_filename = strtok(NULL, ">");
+            ctx->redirect_fd = atoi(strtok_r(token, ">", &saveptr));
+            ctx->redirect_filename = strtok_r(NULL, ">", &saveptr);
         } else {
             if(token[0] != '>') {
-                is_err = true;
+                ctx->is_err = true;
                 return -1;
             }
-            redirect_fd = STDOUT_FILENO;
-            redirect_filename = strtok(token, ">");
+            ctx->redirect_fd = STDOUT_FILENO;
+            ctx->redirect_filename = strtok_r(token, ">", &saveptr);
         }
     }
     else if(strstr(token, "<") != NULL) {
-        redirect_in = true;
+        ctx->redirect_in = true;
 
         if(isdigit(token[0])) {
-            redirect_fd = atoi(strtok(token, "<"));
-            redirect_filename = strtok(NULL, "<");
+            ctx->redirect_fd = atoi(strtok_r(token, "<", &saveptr));
+            ctx->redirect_filename = strtok_r(NULL, "<", &saveptr);
         } else {
             if(token[0] != '<') {
-                is_err = true;
+                ctx->is_err = true;
                 return -1;
             }
-            redirect_fd = STDIN_FILENO;
-            redirect_filename = strtok(token, "<");
+            ctx->redirect_fd = STDIN_FILENO;
+            ctx->redirect_filename = strtok_r(token, "<", &saveptr);
         }
     }
 
+    // a redirection without a file name like a lone '>'
+    if((ctx->redirect_in || ctx->redirect_out) && ctx->redirect_filename == NULL) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+
+/**
+ * Appends n bytes to the buffer dst holding len bytes, the buffer doubles when they don't fit
+ */
+static int appendBytes(wsh_ctx *ctx, char **dst, size_t *len, size_t *cap, const char *src, size_t n) {
+    if(*cap - *len < n) {
+        size_t new_cap = *cap == 0 ? MAXLINE : *cap;
+        while(new_cap - *len < n) new_cap *= 2;
+
+        char *new_dst = wsh_realloc(ctx, MEM_IO, *dst, new_cap);
+        if(new_dst == NULL) return -1;
+
+        *dst = new_dst;
+        *cap = new_cap;
+    }
+
+    memcpy(*dst + *len, src, n);
+    *len += n;
+
     return 0;
+}
+
+
+static int heredoc_put(wsh_ctx *ctx, const char *data, size_t len) {
+    return appendBytes(ctx, &ctx->heredoc_body, &ctx->heredoc_len, &ctx->heredoc_cap, data, len);
+}
+
+
+/**
+ * Appends a line of the body and its '\n', $name and $? anywhere in the line are replaced by their value
+ * The name is NUL terminated in place for the lookup so line must be writable up to line[len]
+ */
+static int heredoc_append(wsh_ctx *ctx, char *line, size_t len, bool expand) {
+    size_t start = 0;
+
+    for(size_t i = 0 ; expand && i < len ; i++) {
+        if(line[i] != '$') continue;
 
+        size_t end = i + 1;
+        if(end < len && line[end] == '?') end++;
+        else while(end < len && (isalnum((unsigned char) line[end]) || line[end] == '_')) end++;
+
+        // a '$' not followed by a name stays as it is
+        if(end == i + 1) continue;
+
+        if(heredoc_put(ctx, line + start, i - start) == -1) return -1;
+
+        char saved = line[end];
+        line[end] = '\0';
+        char *value = getVarValue(ctx, line + i + 1);
+        line[end] = saved;
+
+        if(heredoc_put(ctx, value, strlen(value)) == -1) return -1;
+
+        start = end;
+        i = end - 1;
+    }
+
+    if(heredoc_put(ctx, line + start, len - start) == -1) return -1;
+
+    return heredoc_put(ctx, "\n", 1);
+}
+
+
+/**
+ * Collects the body of the here-document or here-string of the current command
+ * The lines come from the stream the command was read from, up to the line holding only the delimiter
+ * or the end of the input, they are consumed even if the command itself fails
+ * Lines evaluated one at a time read the body from the session stdin like the interactive mode,
+ * a byte at a time so whatever follows the delimiter line is left there for the caller
+ */
+static int read_heredoc(wsh_ctx *ctx) {
+    ctx->heredoc_len = 0;
+
+    if(ctx->heredoc_string) return heredoc_append(ctx, ctx->redirect_filename, strlen(ctx->redirect_filename), true);
+
+    LineReader stdin_reader;
+    LineReader *reader = ctx->reader;
+    bool prompt = false;
+
+    if(reader == NULL) {
+        reader_init(ctx, &stdin_reader, ctx->stdin_fd);
+        stdin_reader.chunk = 1;
+        reader = &stdin_reader;
+        prompt = isatty(ctx->stdin_fd);
+    }
+
+    int rc = 0;
+    char *line;
+    size_t line_length = 0;
+
+    while(true) {
+        if(prompt) {
+            out_write(ctx, "> ", 2);
+            wsh_out_flush(ctx);
+        }
+
+        line = reader_next_line(reader, &line_length);
+        if(line == NULL || strcmp(line, ctx->redirect_filename) == 0) break;
+
+        // keep reading after a failure so the rest of the body isn't run as commands
+        if(rc == 0 && heredoc_append(ctx, line, line_length, ctx->heredoc_expand) == -1) rc = -1;
+    }
+
+    if(reader == &stdin_reader) reader_free(&stdin_reader);
+
+    return rc;
+}
+
+
+/**
+ * Returns a new fd the body can be read from, nothing touches the disk
+ * Bodies that fit in the pipe buffer are written into a pipe right away, larger ones into an anonymous memfd
+ * Only raw syscalls so the child can call it between fork and execv
+ */
+static int heredoc_open(wsh_ctx *ctx) {
+    struct iovec iov = {ctx->heredoc_body, ctx->heredoc_len};
+
+    if(ctx->heredoc_len <= HEREDOC_PIPE_MAX) {
+        int pipe_fds[2];
+        if(pipe2(pipe_fds, O_CLOEXEC) != 0) return -1;
+
+        int rc = writeAll(pipe_fds[1], &iov, 1);
+        close(pipe_fds[1]);
+        if(rc != 0) {
+            close(pipe_fds[0]);
+            return -1;
+        }
+
+        return pipe_fds[0];
+    }
+
+    int fd = memfd_create("wsh-heredoc", MFD_CLOEXEC);
+    if(fd < 0) return -1;
+
+    if(writeAll(fd, &iov, 1) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
 }
 
 
@@ -774,16 +3461,27 @@ int check_redirection(char *token) {
  * Parses the cmd_buf string and breaks it into tokens separated by " "
  * The tokens are then saved in the cmg_args_list array
  */
-int parse_cmd(char *cmd_buf_to_parse) {
+static int parse_cmd(wsh_ctx *ctx, char *cmd_buf_to_parse) {
     // copies cmd_args to curr_command
-    strcpy(curr_command, cmd_buf_to_parse);
+    if(setString(ctx, &ctx->curr_command, &ctx->curr_command_cap, cmd_buf_to_parse, strlen(cmd_buf_to_parse)) == -1) {
+        ctx->cmd_args[0] = NULL;
+        ctx->is_err = true;
+        return -1;
+    }
+
+    clear_redirection_vars(ctx);
+    reap_procsubs(ctx);
 
-    clear_redirection_vars();
+    for(int k = 0 ; k < MAXARGS ; k++) {
+        wsh_free(ctx, ctx->expanded_args[k]);
+        ctx->expanded_args[k] = NULL;
+    }
 
     char *token;
+    char *saveptr = NULL;
 
     // first token
-    token = strtok(cmd_buf_to_parse, " ");
+    token = strtok_r(cmd_buf_to_parse, " ", &saveptr);
 
     int i = 0;
     int redirection_parse_error = 0;
@@ -791,171 +3489,577 @@ int parse_cmd(char *cmd_buf_to_parse) {
         // if we encounter a '#' at the start of any token we stop processing the rest of the input sequence
         if(strlen(token) >= 1 && token[0] == '#') break;
 
-        redirection_parse_error = check_redirection(token);
+        // <(cmd) and >(cmd) become a /dev/fd path once the inner command runs
+        if(strncmp(token, "<(", 2) == 0 || strncmp(token, ">(", 2) == 0) {
+            token = parse_procsub(ctx, token, &saveptr);
+            if(token == NULL) {
+                ctx->cmd_args[0] = NULL;
+                ctx->is_err = true;
+                return -1;
+            }
+        }
+        else {
+            redirection_parse_error = check_redirection(ctx, token);
+        }
+
         if(redirection_parse_error == -1) {
-            clear_redirection_vars();
+            clear_redirection_vars(ctx);
             break;
         }
 
-        if(redirect_in || redirect_out || redirect_err) break;
+        if(ctx->redirect_in || ctx->redirect_out || ctx->redirect_err) break;
+
+        // no room left for the NULL terminating the args
+        if(i == MAXARGS - 1) {
+            ctx->cmd_args[0] = NULL;
+            ctx->is_err = true;
+            return -1;
+        }
         
-        cmd_args[i] = token;
+        ctx->cmd_args[i] = token;
         i++;
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &saveptr);
     }
-    cmd_args[i] = NULL;
+    ctx->cmd_args[i] = NULL;
     
-    if(i > 0 && strcmp(cmd_args[0], "exit") != 0) {
+    if(i > 0 && strcmp(ctx->cmd_args[0], "exit") != 0) {
         // if not exit unset error and execute command, if there is an error in execution it will be set
         // exit is not considered as part of a successful command when sending last command RC
         // So if exit is passed then don't change the is_err let it be what last command set it to be
     
-        is_err = false;
+        ctx->is_err = false;
     }
 
     // replace variables by values
     if(i > 0) {
-        if(replace_vars() == -1) return -1;
+        if(replace_vars(ctx) == -1) return -1;
     }
 
     return 0;
 }
 
 
-int exec_cmd(void) {
-    
-    set_redirection();
+static int exec_cmd(wsh_ctx *ctx) {
 
     bool is_from_history = false;   // stores whether a NON built-in command is requested via history or not
     bool is_built_in = true;
+
+    ctx->stats.commands++;
+
+    // prefixes like timeout only change how the command is launched
+    if(parse_prefixes(ctx) == -1) {
+        ctx->last_status = 1;
+        ctx->is_err = true;
+        ctx->stats.failures++;
+        return -1;
+    }
+
+    ctx->last_status = 0;
+
+    // <(cmd) and >(cmd) run next to the command and are reaped once it is done
+    if(ctx->nprocsubs > 0 && start_procsubs(ctx) == -1) {
+        reap_procsubs(ctx);
+        if(ctx->last_status == 0) ctx->last_status = 1;
+        ctx->is_err = true;
+        ctx->stats.failures++;
+        return -1;
+    }
     
-    if(strcmp(cmd_args[0], "exit") == 0) {      // if the command passed is exit then exit(-1) gracefully
-        if(cmd_args[1] != NULL && strlen(cmd_args[1]) > 0) {
-            is_err = true;
+    if(strcmp(ctx->cmd_args[0], "exit") == 0) {      // if the command passed is exit then the session is over
+        if(ctx->cmd_args[1] != NULL && strlen(ctx->cmd_args[1]) > 0) {
+            ctx->is_err = true;
             return -1;
         }
         else {
-            free_memory();
-            exit(is_err ? -1 : 0);
+            ctx->exited = true;
+            return 0;
         }
     }
-    else if(strcmp(cmd_args[0], "cd") == 0) {    // Built-In change directory
-        cd();
+    else if(strcmp(ctx->cmd_args[0], "cd") == 0) {    // Built-In change directory
+        set_redirection(ctx);
+        cd(ctx);
+    }
+    else if(strcmp(ctx->cmd_args[0], "export") == 0) {   // Built-In export 'GLOBAL' variables
+        set_redirection(ctx);
+        export(ctx);
     }
-    else if(strcmp(cmd_args[0], "export") == 0) {   // Built-In export 'GLOBAL' variables
-        export();
+    else if(strcmp(ctx->cmd_args[0], "local") == 0) {    // Built-In local variables
+        set_redirection(ctx);
+        local(ctx);  
     }
-    else if(strcmp(cmd_args[0], "local") == 0) {    // Built-In local variables
-        local();  
+    else if(strcmp(ctx->cmd_args[0], "vars") == 0) { // Built-In list all the variables
+        set_redirection(ctx);
+        vars(ctx);   
     }
-    else if(strcmp(cmd_args[0], "vars") == 0) { // Built-In list all the variables
-        vars();   
+    else if(strcmp(ctx->cmd_args[0], "history") == 0) {  // Built-In history command
+        set_redirection(ctx);
+        history(ctx, &is_from_history);
     }
-    else if(strcmp(cmd_args[0], "history") == 0) {  // Built-In history command
-        history(&is_from_history);
+    else if(strcmp(ctx->cmd_args[0], "ls") == 0) {   // Built-In ls -1 command
+        set_redirection(ctx);
+        ls(ctx);
     }
-    else if(strcmp(cmd_args[0], "ls") == 0) {   // Built-In ls -1 command
-        ls();
+    else if(strcmp(ctx->cmd_args[0], "ulimit") == 0) {   // Built-In limits for the children
+        set_redirection(ctx);
+        builtin_ulimit(ctx);
+    }
+    else if(strcmp(ctx->cmd_args[0], "stats") == 0) {   // Built-In counters of the session
+        set_redirection(ctx);
+        stats(ctx);
+    }
+    else if(strcmp(ctx->cmd_args[0], "mem") == 0) {     // Built-In memory accounting of the session
+        set_redirection(ctx);
+        mem(ctx);
+    }
+    else if(strcmp(ctx->cmd_args[0], "snapshot") == 0) {    // Built-In save / load the state of the session
+        set_redirection(ctx);
+        snapshot(ctx);
+    }
+    else if(strcmp(ctx->cmd_args[0], "exec") == 0) {    // Built-In replace the shell with a command
+        exec(ctx);
+    }
+    else if(strcmp(ctx->cmd_args[0], "forall") == 0) {  // Built-In parallel fan-out over input lines
+        set_redirection(ctx);
+        forall(ctx);
+    }
+    else if(strcmp(ctx->cmd_args[0], "cached") == 0) {  // Built-In replay the result of an earlier run
+        set_redirection(ctx);
+        cached(ctx);
+    }
+    else if(strcmp(ctx->cmd_args[0], "on-change") == 0) {   // Built-In run a command whenever files change
+        // the redirection belongs to the command, it is applied on every run
+        on_change(ctx);
     }
     else {
         is_built_in = false;
     }
 
     // since it's not a built-in command it will be saved in the history
-    if(!is_from_history && !is_built_in && !(strcmp(last_command, curr_command) == 0)) {
-        addToHistory();
+    if(!is_from_history && !is_built_in && !(ctx->last_command != NULL && strcmp(ctx->last_command, ctx->curr_command) == 0)) {
+        addToHistory(ctx);
     }
 
     // we set the current command being parsed always so that we can use it to update the history quickly
     if(!is_built_in) {
-        // fork and execute in child process
-        run_cmd();
+        // the last command of a batch doesn't need a fork unless the shell has to enforce a timeout
+        if(ctx->tail_candidate && ctx->timeout_ms == 0 && ctx->nprocsubs == 0) exec_replace(ctx, ctx->cmd_args);
+
+        // fork and execute in child process, the child applies the redirection itself
+        else run_cmd(ctx);
 
         // copies cmd_args to last_command
-        strcpy(last_command, curr_command);
+        setString(ctx, &ctx->last_command, &ctx->last_command_cap, ctx->curr_command, strlen(ctx->curr_command));
     }
+    else if(ctx->is_err && ctx->last_status == 0) {
+        ctx->last_status = 1;
+    }
+
+    if(ctx->is_err) ctx->stats.failures++;
 
-    unset_redirection();
+    unset_redirection(ctx);
+    reap_procsubs(ctx);
 
     return 0;
 }
 
 
-int run_batch_mode(char *file_name) {
-    batch_file = fopen(file_name, "r");
+/**
+ * Evaluates a single line of input in the session
+ * Returns -1 if the command failed and 1 once the session ran exit, later lines are then ignored
+ */
+int wsh_eval_line(wsh_ctx *ctx, const char *cmd_line) {
+    if(ctx->exited) return 1;
+
+    size_t len = strlen(cmd_line);
+    if(len > 0 && cmd_line[len - 1] == '\n') len--;
+
+    if(len == 0 || cmd_line[0] == '#') return 0;
+
+    if(setString(ctx, &ctx->line_buf, &ctx->line_buf_cap, cmd_line, len) == -1) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    // parse the input command buffer to tokenize and store in the array
+    parse_cmd(ctx, ctx->line_buf);
+
+    // the body of a here-document follows the command in the input
+    if(ctx->redirect_heredoc && read_heredoc(ctx) == -1) {
+        ctx->is_err = true;
+        return -1;
+    }
+
+    if(ctx->cmd_args[0] == NULL) return 0;
+
+    // check if built-in
+    exec_cmd(ctx);
+
+    if(ctx->exited) return 1;
+
+    return ctx->is_err ? -1 : 0;
+}
+
+
+int wsh_eval_file(wsh_ctx *ctx, const char *file_name) {
+    return run_batch_mode(ctx, file_name);
+}
+
+
+static void reader_init(wsh_ctx *ctx, LineReader *reader, int fd) {
+    reader->ctx = ctx;
+    reader->fd = fd;
+    reader->buf = NULL;
+    reader->cap = 0;
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = false;
+    reader->chunk = READ_CHUNK;
+    reader->lineno = 0;
+}
+
+
+static void reader_free(LineReader *reader) {
+    wsh_free(reader->ctx, reader->buf);
+    reader->buf = NULL;
+    reader->cap = 0;
+}
+
+
+/**
+ * Returns the next line without its '\n', NULL at the end of the input
+ * The buffer is refilled reader->chunk bytes at a time and grows when a single line doesn't fit
+ */
+static char * reader_next_line(LineReader *reader, size_t *line_len) {
+    while(true) {
+        char *line = reader->buf + reader->start;
+        char *nl = reader->start < reader->end ? memchr(line, '\n', reader->end - reader->start) : NULL;
+
+        if(nl != NULL) {
+            *nl = '\0';
+            *line_len = nl - line;
+            reader->start += *line_len + 1;
+            reader->lineno++;
+            return line;
+        }
+
+        if(reader->eof) {
+            // last line of the input without a '\n' at the end
+            if(reader->start == reader->end) return NULL;
+
+            reader->buf[reader->end] = '\0';
+            *line_len = reader->end - reader->start;
+            reader->start = reader->end;
+            reader->lineno++;
+            return line;
+        }
+
+        // move the partial line to the front to make room for the next chunk
+        if(reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+
+        // one extra byte so the last line can always be NUL terminated
+        if(reader->cap - reader->end < reader->chunk + 1) {
+            size_t new_cap = reader->cap == 0 ? reader->chunk + 1 : reader->cap * 2;
+            char *new_buf = wsh_realloc(reader->ctx, MEM_IO, reader->buf, new_cap);
+            if(new_buf == NULL) return NULL;
+
+            reader->buf = new_buf;
+            reader->cap = new_cap;
+        }
+
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->chunk);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) reader->eof = true;
+        else reader->end += n;
+    }
+}
+
+
+/**
+ * Checks whether only blank lines and comments are left in the input, reading ahead if needed
+ * The data read ahead stays in the buffer for reader_next_line, which may move it
+ * so the last returned line must not be used after this
+ */
+static bool reader_at_end(LineReader *reader) {
+    size_t pos = reader->start;
+
+    while(true) {
+        while(pos < reader->end) {
+            char *p = reader->buf + pos;
+            char *nl = memchr(p, '\n', reader->end - pos);
+
+            // last line without a '\n', there is no more data if we are at the end of the input
+            if(nl == NULL) {
+                if(!reader->eof) break;
+                return *p == '#';
+            }
+
+            if(nl != p && *p != '#') return false;
+            pos = nl - reader->buf + 1;
+        }
+
+        if(pos >= reader->end && reader->eof) return true;
+
+        if(reader->cap - reader->end < reader->chunk + 1) {
+            size_t new_cap = reader->cap == 0 ? reader->chunk + 1 : reader->cap * 2;
+            char *new_buf = wsh_realloc(reader->ctx, MEM_IO, reader->buf, new_cap);
+            if(new_buf == NULL) return false;
 
-    // if batch file doesn't exist exit with -1
-    // no need of freeing any memory
-    if(batch_file == NULL) {
-        exit(-1);
+            reader->buf = new_buf;
+            reader->cap = new_cap;
+        }
+
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->chunk);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) reader->eof = true;
+        else reader->end += n;
     }
+}
+
 
-    line = NULL;
-    size_t line_buf_sz = 0;
-    ssize_t line_length = 0;
+/**
+ * Runs every line read from fd through the same parse / exec path
+ * Used for batch files and for stdin when it isn't a terminal, no prompts are printed
+ */
+int wsh_run_stream(wsh_ctx *ctx, int fd) {
+    LineReader reader;
+    reader_init(ctx, &reader, fd);
+
+    char *line;
+    size_t line_length = 0;
+
+    // copy of the line while the reader looks past it
+    char *tail_line = NULL;
+    size_t tail_line_cap = 0;
 
-    while((line_length = getline(&line, &line_buf_sz, batch_file)) != -1) {
-        if(line_length <= 1 || line[0] == '#') continue;
+    // here-documents take their body from the same stream
+    LineReader *outer_reader = ctx->reader;
+    ctx->reader = &reader;
 
-        if(line[strlen(line) - 1] == EOF) {
-            free_memory();
-            exit(is_err ? -1 : 0);
+    while(!ctx->exited && (line = reader_next_line(&reader, &line_length)) != NULL) {
+        if(line_length == 0 || line[0] == '#') continue;
+
+        // nothing after the last command can observe the shell, so it may replace the shell
+        if(ctx->tail_exec && setString(ctx, &tail_line, &tail_line_cap, line, line_length) == 0) {
+            line = tail_line;
+            ctx->tail_candidate = reader_at_end(&reader);
         }
 
-        if(line[strlen(line) - 1] == '\n') line[strlen(line) - 1] = '\0';
+        if(ctx->profile != NULL) profile_line(ctx, reader.lineno, line, line_length);
+        else wsh_eval_line(ctx, line);
+        ctx->tail_candidate = false;
+    }
+
+    ctx->reader = outer_reader;
+    wsh_free(ctx, tail_line);
+    reader_free(&reader);
+
+    return ctx->is_err ? -1 : 0;
+}
+
+
+static int run_batch_mode(wsh_ctx *ctx, const char *file_name) {
+    int fd = openat(ctx->cwd_fd, file_name, O_RDONLY | O_CLOEXEC);
+
+    // if batch file doesn't exist the session fails
+    if(fd < 0) {
+        ctx->is_err = true;
+        return -1;
+    }
 
-        // parse the input command buffer to tokenize and store in the array
-        parse_cmd(line);
+    wsh_run_stream(ctx, fd);
+    close(fd);
+
+    return ctx->is_err ? -1 : 0;
+}
 
-        if(cmd_args[0] == NULL) continue;
 
-        // check if built-in
-        exec_cmd();
+/**
+ * Starts profiling the batch run of script, wsh_run_stream then goes through profile_line for every line
+ */
+int wsh_profile_start(wsh_ctx *ctx, const char *script) {
+    Profile *profile = wsh_calloc(ctx, MEM_IO, 1, sizeof(Profile));
+    if(profile == NULL) return -1;
+
+    profile->script = wsh_strdup(ctx, MEM_IO, script);
+    profile->dir_fd = fcntl(ctx->cwd_fd, F_DUPFD_CLOEXEC, 0);
+    if(profile->script == NULL || profile->dir_fd < 0) {
+        if(profile->dir_fd >= 0) close(profile->dir_fd);
+        wsh_free(ctx, profile->script);
+        wsh_free(ctx, profile);
+        return -1;
     }
 
+    ctx->profile = profile;
     return 0;
 }
 
-int main(int argc, char* argv[]) {
 
-    // we need to set PATH to /bin initially
-    putenv("PATH=/bin");
+/**
+ * Returns what the line ran for the folded stacks, the command itself or, when the line went through
+ * history n, a prefix or a built-in running other commands, that word and the command below it
+ */
+static char * profile_frames(wsh_ctx *ctx, const char *text) {
+    char frames[256];
+    size_t word_len = strcspn(text, " ");
+    const char *cmd = ctx->cmd_args[0];
+
+    if(cmd == NULL || (strncmp(text, cmd, word_len) == 0 && cmd[word_len] == '\0')) {
+        snprintf(frames, sizeof(frames), "%.*s", (int) word_len, text);
+    }
+    else if(strncmp(text, "history ", 8) == 0) {
+        snprintf(frames, sizeof(frames), "%.*s;%s", (int) strcspn(text, ";"), text, cmd);
+    }
+    else {
+        snprintf(frames, sizeof(frames), "%.*s;%s", (int) word_len, text, cmd);
+    }
+
+    return wsh_strdup(ctx, MEM_IO, frames);
+}
+
+
+/**
+ * Evaluates a line of the profiled script and adds its count, wall time, child cpu time and failure
+ * to the line
+ */
+static void profile_line(wsh_ctx *ctx, unsigned long lineno, const char *line, size_t line_length) {
+    Profile *profile = ctx->profile;
+    ProfileLine *rec = NULL;
+
+    if(lineno >= profile->cap) {
+        unsigned long new_cap = profile->cap == 0 ? 1024 : profile->cap;
+        while(new_cap <= lineno) new_cap *= 2;
+
+        ProfileLine *new_lines = wsh_realloc(ctx, MEM_IO, profile->lines, new_cap * sizeof(ProfileLine));
+        if(new_lines != NULL) {
+            memset(new_lines + profile->cap, 0, (new_cap - profile->cap) * sizeof(ProfileLine));
+            profile->lines = new_lines;
+            profile->cap = new_cap;
+        }
+    }
+
+    if(lineno < profile->cap) {
+        rec = &profile->lines[lineno];
+        rec->lineno = lineno;
+
+        // copied before the line runs, a here-document may move the reader buffer under it
+        if(rec->text == NULL) {
+            rec->text = wsh_malloc(ctx, MEM_IO, line_length + 1);
+            if(rec->text != NULL) {
+                memcpy(rec->text, line, line_length);
+                rec->text[line_length] = '\0';
+            }
+        }
+    }
+
+    long cpu_us = ctx->child_cpu_us;
+    long start_us = monotonicUs();
+
+    int rc = wsh_eval_line(ctx, line);
+
+    if(rec == NULL || rec->text == NULL) return;
+
+    rec->count++;
+    rec->wall_us += monotonicUs() - start_us;
+    rec->cpu_us += ctx->child_cpu_us - cpu_us;
+    if(rc == -1) rec->failures++;
+
+    if(rec->frames == NULL) rec->frames = profile_frames(ctx, rec->text);
+}
+
+
+static int compareProfileLines(const void *a, const void *b) {
+    const ProfileLine *x = *(ProfileLine * const *) a;
+    const ProfileLine *y = *(ProfileLine * const *) b;
 
-    // if the program was invoked with 2 arguments then it is batch mode
-    // with the 2nd argument being the batch file name
-    if(argc == 2) {
-        // Batch Mode
-        run_batch_mode(argv[1]);
+    if(x->wall_us != y->wall_us) return x->wall_us > y->wall_us ? -1 : 1;
 
-        free_memory();
-        return is_err ? -1 : 0;
-    } else if(argc > 2) {
-        // if more than 2 arguments were passed then it's an error
-        exit(-1);
+    return x->lineno < y->lineno ? -1 : 1;
+}
+
+
+/**
+ * Writes script.prof, the lines that ran sorted by wall time, and script.folded, one folded stack
+ * per line in script order for flamegraph tools with the wall time in microseconds as its value
+ */
+int wsh_profile_write(wsh_ctx *ctx) {
+    Profile *profile = ctx->profile;
+    char file_name[PATH_MAX];
+
+    ProfileLine **ran = wsh_malloc(ctx, MEM_IO, (profile->cap + 1) * sizeof(ProfileLine*));
+    if(ran == NULL) return -1;
+
+    size_t nran = 0;
+    long total_wall_us = 0;
+    long total_cpu_us = 0;
+    for(unsigned long i = 0 ; i < profile->cap ; i++) {
+        if(profile->lines[i].count == 0) continue;
+
+        ran[nran++] = &profile->lines[i];
+        total_wall_us += profile->lines[i].wall_us;
+        total_cpu_us += profile->lines[i].cpu_us;
     }
 
-    char cmd_buf[MAXLINE];
+    // both reports go through the output layer of the session
+    wsh_out_flush(ctx);
+    int saved_out = ctx->out;
+    int rc = 0;
+
+    snprintf(file_name, sizeof(file_name), "%s.folded", profile->script);
+    ctx->out = openat(profile->dir_fd, file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(ctx->out >= 0) {
+        for(size_t i = 0 ; i < nran ; i++) {
+            out_printf(ctx, "%s;%lu: ", profile->script, ran[i]->lineno);
+            for(const char *p = ran[i]->text ; *p != '\0' && p < ran[i]->text + 80 ; p++) out_write(ctx, *p == ';' ? ":" : p, 1);
+            out_printf(ctx, ";%s %ld\n", ran[i]->frames != NULL ? ran[i]->frames : "", ran[i]->wall_us);
+        }
+        wsh_out_flush(ctx);
+        close(ctx->out);
+    }
+    else {
+        rc = -1;
+    }
 
-    // the read_cmd function prints 'wsh> ' and takes input from the user
-    while(read_cmd(cmd_buf, sizeof(cmd_buf)) >= 0) {
-        if(strlen(cmd_buf) <= 1 || cmd_buf[0] == '#') continue;
+    qsort(ran, nran, sizeof(ProfileLine*), compareProfileLines);
 
-        if(cmd_buf[strlen(cmd_buf) - 1] == EOF) {
-            free_memory();
-            exit(is_err ? -1 : 0);
+    snprintf(file_name, sizeof(file_name), "%s.prof", profile->script);
+    ctx->out = openat(profile->dir_fd, file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(ctx->out >= 0) {
+        out_printf(ctx, "%8s %8s %12s %12s %8s  %s\n", "line", "count", "wall_ms", "cpu_ms", "failures", "command");
+        for(size_t i = 0 ; i < nran ; i++) {
+            out_printf(ctx, "%8lu %8lu %12.3f %12.3f %8lu  %s\n", ran[i]->lineno, ran[i]->count, ran[i]->wall_us / 1000.0,
+                       ran[i]->cpu_us / 1000.0, ran[i]->failures, ran[i]->text);
         }
+        out_printf(ctx, "%8s %8zu %12.3f %12.3f\n", "total", nran, total_wall_us / 1000.0, total_cpu_us / 1000.0);
+        wsh_out_flush(ctx);
+        close(ctx->out);
+    }
+    else {
+        rc = -1;
+    }
 
-        if(cmd_buf[strlen(cmd_buf) - 1] == '\n') cmd_buf[strlen(cmd_buf) - 1] = '\0';
+    ctx->out = saved_out;
+    wsh_free(ctx, ran);
+
+    return rc;
+}
 
-        // parse the input command buffer to tokenize and store in the array
-        parse_cmd(cmd_buf);
 
-        if(cmd_args[0] == NULL) continue;
+static void profile_free(wsh_ctx *ctx) {
+    Profile *profile = ctx->profile;
+    if(profile == NULL) return;
 
-        // check if built-in
-        exec_cmd();
+    for(unsigned long i = 0 ; i < profile->cap ; i++) {
+        wsh_free(ctx, profile->lines[i].text);
+        wsh_free(ctx, profile->lines[i].frames);
     }
-    
-    free_memory();
-    return is_err ? -1 : 0;
+    wsh_free(ctx, profile->lines);
+    wsh_free(ctx, profile->script);
+    close(profile->dir_fd);
+    wsh_free(ctx, profile);
+
+    ctx->profile = NULL;
 }
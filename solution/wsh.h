@@ -1,48 +1,20 @@
-#define HISTORY_SIZE 5      // Initial size of History
-#define MAXLINE 1024        // Maximum length of input to wsh i.e. a single command
-#define MAXARGS 128         // Maximum number of arguments to parse for the input command cp {-r -s -t} => 3
+#ifndef WSH_H
+#define WSH_H
 
-typedef struct HistNode {
-    char cmd[MAXLINE];
-    struct HistNode *next;
-    struct HistNode *prev;
-} HistNode;
+#ifdef __cplusplus
+extern "C" {
+#endif
 
-typedef struct LocalNode {
-    char *varname;
-    char *varvalue;
-    struct LocalNode *next;
-} LocalNode;
+// A shell session, see wsh_ctx_new
+typedef struct wsh_ctx wsh_ctx;
 
-void free_memory(void);
-int count_cmd_args(void);
+wsh_ctx * wsh_ctx_new(void);
+int wsh_eval_line(wsh_ctx *, const char *);
+int wsh_eval_file(wsh_ctx *, const char *);
+void wsh_ctx_free(wsh_ctx *);
 
-char * getVarValue(char *);
-int replace_vars(void);
+#ifdef __cplusplus
+}
+#endif
 
-void clear_redirection_vars(void);
-int set_redirection(void);
-int unset_redirection(void);
-int check_redirection(char *);
-
-void printHistory(void);
-char * searchHistory(int);
-void addToHistory(void);
-void updateHistoryCapacity(int);
-int history(bool *);
-
-int exclude_hidden_files(const struct dirent *);
-int ls(void);
-int cd(void);
-int export(void);
-
-int vars(void);
-char * searchLocal(char *);
-int local(void);
-
-int run_cmd(void);
-int read_cmd(char *, size_t);
-int parse_cmd(char *);
-int exec_cmd(void);
-
-int run_batch_mode(char *);
+#endif
@@ -0,0 +1,355 @@
+#ifndef WSH_INTERNAL_H
+#define WSH_INTERNAL_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "wsh.h"
+
+#define HISTORY_SIZE 5      // Initial size of History
+#define MAXLINE 1024        // Initial size of the line buffers, they grow for longer commands
+#define MAXARGS 128         // Maximum number of arguments to parse for the input command cp {-r -s -t} => 3
+#define READ_CHUNK 65536    // Size of the read() calls made by the stream reader
+#define OUTBUF_SIZE 65536   // Size of the buffer the output of the built-ins is collected in
+#define HEREDOC_PIPE_MAX 4096   // Bodies up to this size are fed through a pipe, larger ones through a memfd
+#define MAXPROCSUBS 16      // Maximum number of <(cmd) / >(cmd) in one command
+#define CACHE_MAX_BYTES (64L << 20) // Size the result cache is kept under unless WSH_CACHE_SIZE says otherwise
+#define ON_CHANGE_DEBOUNCE_MS 50    // Events closer together than this are one change for on-change
+#define NLIMITS 7           // Number of resources the ulimit built-in knows about
+#define TIMEOUT_KILL_MS 1000    // Time a timed out command gets between SIGTERM and SIGKILL
+#define TIMEOUT_STATUS 124      // $? of a command killed by timeout
+#define MAXCPUS 1024        // Highest cpu number + 1 that affinity and WSH_CPUSET can name
+#define CPU_MASK_WORDS (MAXCPUS / (8 * sizeof(unsigned long)))
+#define FORALL_MAX_PROCS 4096   // Highest -P forall accepts
+
+#define HIST_INDEX_BITS 16  // The history search index has 2^HIST_INDEX_BITS trigram buckets
+#define HIST_INDEX_BUCKETS (1 << HIST_INDEX_BITS)
+
+typedef struct HistNode {
+    struct HistNode *next;
+    struct HistNode *prev;
+    struct HistNode *hnext;     // next entry in the same bucket of the history hash set
+    unsigned long hash;
+    unsigned long seq;          // insertion number, grows from the oldest to the newest entry
+    char cmd[];
+} HistNode;
+
+typedef struct PostingList {
+    unsigned long *seqs;
+    unsigned int len;
+    unsigned int cap;
+} PostingList;
+
+/**
+ * Trigram index used by history search
+ * Every bucket lists the seqs of the entries having a trigram hashing to it, entries removed
+ * since the last rebuild stay in the lists and are skipped through by_seq
+ */
+typedef struct HistIndex {
+    PostingList lists[HIST_INDEX_BUCKETS];
+    HistNode **by_seq;          // live entry of every seq, NULL once removed
+    int *fenwick;               // live seqs, turns a seq into its number in the history
+    unsigned long seq_cap;
+    unsigned long live;
+    unsigned long dead;
+} HistIndex;
+
+typedef struct LocalNode {
+    char *varname;
+    char *varvalue;
+    struct LocalNode *next;
+} LocalNode;
+
+/**
+ * Reads a fd line by line with large read() calls
+ * Lines are split in place, so a returned line stays valid until the next call
+ */
+typedef struct LineReader {
+    struct wsh_ctx *ctx;
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+    bool eof;
+    size_t chunk;               // bytes asked for per read(), 1 to never consume past the line returned
+    unsigned long lineno;
+} LineReader;
+
+/**
+ * A <(cmd) or >(cmd) of the current command
+ * cmd runs on one end of a pipe and the command gets path, the /dev/fd/N of the other end
+ */
+typedef struct ProcSub {
+    char *cmd;          // inner command, points into the line being parsed
+    bool write;         // >(cmd), the command writes and cmd reads
+    pid_t pid;
+    int fd;
+    char path[32];
+} ProcSub;
+
+// Subsystems the allocations of a session are counted against
+#define MEM_HISTORY 0
+#define MEM_LOCALS 1
+#define MEM_PARSE 2
+#define MEM_ENV 3
+#define MEM_IO 4
+#define MEM_SUBSYSTEMS 5
+
+typedef struct MemHeader {
+    size_t size;
+    size_t subsystem;
+} MemHeader;
+
+typedef struct MemStats {
+    long live;
+    long peak;
+    unsigned long allocs;
+} MemStats;
+
+#define SNAPSHOT_MAGIC "WSHSNAP"
+#define SNAPSHOT_VERSION 1
+
+/**
+ * Start of a snapshot file, followed by the strings of the session each stored as a uint32_t
+ * length and the NUL terminated bytes: the cwd, name and value of every local, the environment
+ * entries and the history from the oldest to the newest entry
+ */
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t history_capacity;
+    uint32_t nlocals;
+    uint32_t nenv;
+    uint32_t nhist;
+    uint32_t reserved;
+    uint64_t size;              // size of the whole file
+} SnapshotHeader;
+
+#define CACHE_MAGIC "WSHCACH"
+#define CACHE_VERSION 1
+
+/**
+ * Start of a result cache entry, followed by the key, the stdout and the stderr of the command
+ * The whole key is kept so a hash collision is never replayed as a hit
+ */
+typedef struct CacheEntryHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t status;
+    uint64_t key_len;
+    uint64_t out_len;
+    uint64_t err_len;
+} CacheEntryHeader;
+
+// entry of the cache directory looked at by the eviction
+typedef struct CacheFile {
+    struct timespec used;
+    off_t size;
+    char name[32];
+} CacheFile;
+
+/**
+ * inotify watches of the on-change built-in
+ * paths is indexed by watch descriptor so the path of an event can be found without a search
+ */
+typedef struct WatchSet {
+    int fd;
+    bool recursive;
+    char **paths;
+    int cap;
+    int live;           // watches left, a set without any would never see another event
+} WatchSet;
+
+/**
+ * What the profiler knows about one line of the script
+ */
+typedef struct ProfileLine {
+    unsigned long lineno;
+    unsigned long count;
+    long wall_us;
+    long cpu_us;            // user + system time of the children the line waited for
+    unsigned long failures;
+    char *text;             // the line as written, NULL for a line that never ran
+    char *frames;           // the command it ran, below the line in the folded stacks
+} ProfileLine;
+
+/**
+ * Profile of a batch run, see wsh --profile
+ */
+typedef struct Profile {
+    ProfileLine *lines;     // indexed by line number
+    unsigned long cap;
+    char *script;
+    int dir_fd;             // the reports are written relative to the cwd the run started in
+} Profile;
+
+/**
+ * Counters reported by the stats built-in
+ */
+typedef struct WshStats {
+    unsigned long commands;
+    unsigned long children;
+    unsigned long failures;
+    unsigned long timeouts;
+} WshStats;
+
+/**
+ * All the state of one shell session
+ * Nothing in here is shared between contexts so independent contexts can be driven from different threads
+ * The working directory and the environment are kept per context as well and only handed to the children
+ */
+struct wsh_ctx {
+    int history_capacity;
+    int curr_history_size;
+
+    HistNode *histHead;
+    HistNode *histTail;
+
+    // hash set of the history entries, lets erasedups find a previous copy in O(1)
+    HistNode **hist_buckets;
+    unsigned long hist_nbuckets;
+
+    unsigned long hist_next_seq;
+
+    // histcontrol contains erasedups, updated whenever the variable is set
+    bool hist_erasedups;
+    HistIndex *hist_index;      // NULL until the first history search
+
+    LocalNode *localHead;
+
+    // environment passed to the children, entries are malloc'd "name=value" strings
+    char **env;
+    int env_len;
+    int env_cap;
+
+    // directory fd used as the working directory of this session
+    int cwd_fd;
+
+    // fds the session reads from / writes to, 0 1 2 unless the embedder changes them
+    int stdin_fd;
+    int stdout_fd;
+    int stderr_fd;
+
+    // fd the built-ins print to, stdout_fd unless redirected
+    int out;
+
+    // output of the built-ins not written to out yet
+    char *outbuf;
+    size_t outbuf_len;
+
+    // stores the tokenized input command issued by the user
+    char *cmd_args[MAXARGS];
+
+    // tokens allocated by replace_vars, freed before the next parse
+    char *expanded_args[MAXARGS];
+
+    // stores the last command issued by the user
+    char *last_command;
+    size_t last_command_cap;
+    char *curr_command;
+    size_t curr_command_cap;
+
+    // buffer the current line is parsed from
+    char *line_buf;
+    size_t line_buf_cap;
+
+    // history_cmd
+    char *history_cmd;
+    size_t history_cmd_cap;
+
+    // redirection
+    bool redirect_append;
+
+    bool redirect_in;
+    bool redirect_out;
+    bool redirect_err;
+
+    char *redirect_filename;
+    int redirect_fd;
+
+    // file opened for a redirected built-in, or the fd a here-document is read from
+    int redirect_open_fd;
+
+    // here-document (<<WORD) or here-string (<<<word) feeding the command
+    bool redirect_heredoc;
+    bool heredoc_string;
+    bool heredoc_expand;        // false when the delimiter was quoted
+    char *heredoc_body;
+    size_t heredoc_len;
+    size_t heredoc_cap;
+
+    // process substitutions of the current command
+    ProcSub procsubs[MAXPROCSUBS];
+    int nprocsubs;
+    long procsub_deadline;      // monotonic ms the timeout of the command ends at, 0 without one
+
+    // stream the current line came from, here-document bodies are read from it
+    LineReader *reader;
+
+    // error executing cmds
+    bool is_err;
+
+    // exit status of the last command, what $? expands to
+    int last_status;
+    char last_status_buf[16];
+
+    // limits set by the ulimit built-in, applied in every child
+    rlim_t limits[NLIMITS];
+    bool limit_set[NLIMITS];
+
+    // set by the timeout prefix for the current command only, 0 means no timeout
+    long timeout_ms;
+
+    // cpus the current command is pinned to, from the affinity prefix or WSH_CPUSET
+    unsigned long cpu_mask[CPU_MASK_WORDS];
+    bool cpu_mask_set;
+
+    // WSH_CPUSET parsed whenever it is set, unset while it is empty or not a valid cpu list
+    unsigned long default_cpu_mask[CPU_MASK_WORDS];
+    bool default_cpu_mask_set;
+
+    // increment set by the nice prefix for the current command
+    int nice_inc;
+
+    // cpu a parallel job is pinned to, -1 outside of forall
+    int job_cpu;
+    int cpu_rr;
+
+    WshStats stats;
+
+    // user + system time of the children reaped by the session
+    long child_cpu_us;
+
+    // NULL unless the batch run is profiled
+    Profile *profile;
+
+    // bytes allocated through wsh_malloc and friends
+    MemStats mem[MEM_SUBSYSTEMS];
+    long mem_live;
+    long mem_peak;
+
+    // set once the exit built-in ran
+    bool exited;
+
+    // the last command of a stream replaces the shell instead of being forked, off unless enabled
+    bool tail_exec;
+    bool tail_candidate;
+};
+
+// Shared with main.c, not part of the library interface so kept out of the symbols libwsh.so exports
+#pragma GCC visibility push(hidden)
+int wsh_out_flush(wsh_ctx *);
+void wsh_print_stats(wsh_ctx *);
+void wsh_print_mem(wsh_ctx *);
+int wsh_snapshot_load(wsh_ctx *, const char *);
+int wsh_profile_start(wsh_ctx *, const char *);
+int wsh_profile_write(wsh_ctx *);
+int wsh_run_stream(wsh_ctx *, int);
+#pragma GCC visibility pop
+
+#endif
@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wsh.h"
+
+#define RUNS 50
+
+// every thread drives its own session, they must not see each other's state
+void * session(void *arg) {
+    long id = (long) arg;
+    char line[64];
+    wsh_ctx *ctx = wsh_ctx_new();
+
+    wsh_eval_line(ctx, id == 0 ? "cd /" : "cd /usr");
+    snprintf(line, sizeof(line), "local id=%ld", id);
+    wsh_eval_line(ctx, line);
+    snprintf(line, sizeof(line), "export ID=%ld", id);
+    wsh_eval_line(ctx, line);
+
+    long fails = 0;
+    for(int i = 0 ; i < RUNS ; i++) {
+        if(wsh_eval_line(ctx, "test $ID = $id") != 0) fails++;
+        if(wsh_eval_line(ctx, id == 0 ? "test -d bin" : "test -d lib") != 0) fails++;
+    }
+
+    if(wsh_eval_line(ctx, "exit") != 1) fails++;
+    if(wsh_eval_line(ctx, "test -d /") != 1) fails++;
+    wsh_ctx_free(ctx);
+
+    return (void *) fails;
+}
+
+int main(void) {
+    pthread_t threads[2];
+    for(long i = 0 ; i < 2 ; i++) pthread_create(&threads[i], NULL, session, (void *) i);
+
+    for(int i = 0 ; i < 2 ; i++) {
+        void *fails;
+        pthread_join(threads[i], &fails);
+        printf("session %d: %ld failures\n", i, (long) fails);
+    }
+
+    // the body of a here-document comes from stdin, what follows the delimiter is left for the caller
+    fflush(stdout);
+    wsh_ctx *ctx = wsh_ctx_new();
+    wsh_eval_line(ctx, "cat <<EOF");
+    wsh_ctx_free(ctx);
+
+    char rest[64];
+    ssize_t n = read(STDIN_FILENO, rest, sizeof(rest));
+    printf("left: %.*s", (int) (n > 0 ? n : 0), rest);
+
+    return 0;
+}